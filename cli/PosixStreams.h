@@ -43,8 +43,8 @@ namespace cli
 		void SetProgressReporter(const decltype(_progressReporter) & pr)
 		{ _progressReporter = pr; }
 
-		void SetTotal(mtp::u64 total)
-		{ _current = 0; _total = total; }
+		void SetTotal(mtp::u64 total, mtp::u64 current = 0)
+		{ _current = current; _total = total; }
 
 	protected:
 		void Report(mtp::u64 delta)
@@ -84,6 +84,13 @@ namespace cli
 		mtp::u64 GetSize() const
 		{ return _size; }
 
+		virtual bool Seek(mtp::u64 offset)
+		{
+			if (lseek(_fd, offset, SEEK_SET) == (off_t)-1)
+				throw std::runtime_error("seek failed");
+			return true;
+		}
+
 		virtual size_t Read(mtp::u8 *data, size_t size)
 		{
 			CheckCancelled();
@@ -111,6 +118,21 @@ namespace cli
 			}
 		}
 
+		///opens existing file keeping first offset bytes and appending after them
+		ObjectOutputStream(const std::string &fname, mtp::u64 offset) : _fd(open(fname.c_str(), O_WRONLY | O_CREAT, 0644))
+		{
+			if (_fd < 0)
+			{
+				perror("open");
+				throw std::runtime_error("cannot open file: " + fname);
+			}
+			if (ftruncate(_fd, offset) != 0 || lseek(_fd, offset, SEEK_SET) == (off_t)-1)
+			{
+				close(_fd);
+				throw std::runtime_error("cannot seek file: " + fname);
+			}
+		}
+
 		~ObjectOutputStream()
 		{ close(_fd); }
 
@@ -123,6 +145,12 @@ namespace cli
 			Report(r);
 			return r;
 		}
+
+		virtual void Sync()
+		{
+			if (fsync(_fd) != 0)
+				throw std::runtime_error("fsync failed");
+		}
 	};
 
 }
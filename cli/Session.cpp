@@ -26,6 +26,7 @@
 #include <mtp/make_function.h>
 #include <mtp/ptp/ByteArrayObjectStream.h>
 #include <mtp/ptp/ObjectPropertyListParser.h>
+#include <mtp/ptp/TransferJournal.h>
 #include <mtp/log.h>
 
 #include <sstream>
@@ -90,10 +91,26 @@ namespace cli
 		AddCommand("put", "put <file> <dir> uploads file to directory",
 			make_function([this](const LocalPath &path, const Path &dst) -> void { Put(path, dst); }));
 
+		AddCommand("put-resume", "<file> uploads file, continuing interrupted upload",
+			make_function([this](const LocalPath &path) -> void { Put(_cd, GetFilename(path), path, PutMode::Resume); }));
+
+		AddCommand("put-resume", "<file> <dir> uploads file to directory, continuing interrupted upload",
+			make_function([this](const LocalPath &path, const Path &dst) -> void { Put(path, dst, PutMode::Resume); }));
+
+		AddCommand("update", "<file> uploads only appended tail if remote file is its unchanged beginning",
+			make_function([this](const LocalPath &path) -> void { Put(_cd, GetFilename(path), path, PutMode::Update); }));
+
+		AddCommand("update", "<file> <dir> uploads only appended tail to directory if remote file is its unchanged beginning",
+			make_function([this](const LocalPath &path, const Path &dst) -> void { Put(path, dst, PutMode::Update); }));
+
 		AddCommand("get", "<file> downloads file",
 			make_function([this](const Path &path) -> void { Get(path); }));
 		AddCommand("get", "<file> <dst> downloads file to <dst>",
 			make_function([this](const Path &path, const LocalPath &dst) -> void { Get(dst, path); }));
+		AddCommand("get-resume", "<file> downloads file, continuing interrupted download",
+			make_function([this](const Path &path) -> void { GetResumable(path); }));
+		AddCommand("get-resume", "<file> <dst> downloads file to <dst>, continuing interrupted download",
+			make_function([this](const Path &path, const LocalPath &dst) -> void { GetResumable(dst, path); }));
 		AddCommand("cat", "<file> outputs file",
 			make_function([this](const Path &path) -> void { Cat(path); }));
 
@@ -466,7 +483,7 @@ namespace cli
 		}
 	}
 
-	void Session::Get(const LocalPath &dst, mtp::ObjectId srcId)
+	void Session::Get(const LocalPath &dst, mtp::ObjectId srcId, bool resume)
 	{
 		mtp::ObjectFormat format = static_cast<mtp::ObjectFormat>(_session->GetObjectIntegerProperty(srcId, mtp::ObjectProperty::ObjectFormat));
 		if (format == mtp::ObjectFormat::Association)
@@ -477,27 +494,67 @@ namespace cli
 			{
 				auto info = _session->GetObjectInfo(id);
 				LocalPath dstFile = dst + "/" + info.Filename;
-				Get(dstFile, id);
+				Get(dstFile, id, resume);
 			}
 		}
+		else if (resume)
+			GetFileResumable(dst, srcId);
 		else
+			GetFile(dst, srcId);
+	}
+
+	void Session::GetFile(const LocalPath &dst, mtp::ObjectId srcId)
+	{
+		auto stream = std::make_shared<ObjectOutputStream>(dst);
+		bool chunked = _session->GetPartialObject64Supported();
+		mtp::u64 size = 0;
+		if (IsInteractive() || chunked)
+			size = _session->GetObjectIntegerProperty(srcId, mtp::ObjectProperty::ObjectSize);
+		if (IsInteractive())
 		{
-			auto stream = std::make_shared<ObjectOutputStream>(dst);
-			if (IsInteractive())
-			{
-				mtp::u64 size = _session->GetObjectIntegerProperty(srcId, mtp::ObjectProperty::ObjectSize);
-				stream->SetTotal(size);
-				if (IsInteractive())
-					try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
-			}
+			stream->SetTotal(size);
+			try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
+		}
+		//chunked transfer does not block other transactions for the whole object
+		if (chunked)
+			_session->GetPartialObject(srcId, 0, size, stream);
+		else
 			_session->GetObject(srcId, stream);
+	}
+
+	void Session::GetFileResumable(const LocalPath &dst, mtp::ObjectId srcId)
+	{
+		using namespace mtp;
+		TransferJournal journal(TransferJournal::GetPath(dst));
+		TransferJournal::Record record = TransferJournal::GetObjectRecord(*_session, srcId);
+
+		TransferJournal::Record saved;
+		struct stat st;
+		if (journal.Load(saved) && saved.SameObject(record) && stat(dst.c_str(), &st) == 0)
+		{
+			record.Offset = std::min<u64>(saved.Offset, st.st_size);
+			if (record.Offset)
+				print("resuming ", dst, " from ", record.Offset, " of ", record.Size);
 		}
+
+		auto stream = std::make_shared<ObjectOutputStream>(dst, record.Offset);
+		journal.Save(record);
+		if (IsInteractive())
+		{
+			stream->SetTotal(record.Size, record.Offset);
+			try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
+		}
+
+		//checkpoint must never point past data which survives a crash
+		_session->GetPartialObject(srcId, record.Offset, record.Size - record.Offset, stream,
+			[&](u64 offset) { stream->Sync(); record.Offset = offset; journal.Save(record); });
+		journal.Remove();
 	}
 
-	void Session::Get(mtp::ObjectId srcId)
+	void Session::Get(mtp::ObjectId srcId, bool resume)
 	{
 		auto info = _session->GetObjectInfo(srcId);
-		Get(LocalPath(info.Filename), srcId);
+		Get(LocalPath(info.Filename), srcId, resume);
 	}
 
 	void Session::Cat(const Path &path)
@@ -521,7 +578,7 @@ namespace cli
 		return ResolveObjectChild(parentId, src);
 	}
 
-	void Session::Put(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src)
+	void Session::Put(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src, PutMode mode)
 	{
 		using namespace mtp;
 		struct stat st = {};
@@ -554,26 +611,147 @@ namespace cli
 					continue;
 
 				std::string fname = result->d_name;
-				Put(dirId, dst + "/" + fname, src + "/" + fname);
+				Put(dirId, dst + "/" + fname, src + "/" + fname, mode);
 			}
 			closedir(dir);
 		}
+		else if (mode == PutMode::Resume)
+			PutFileResumable(parentId, dst, src);
+		else if (mode == PutMode::Update)
+			UpdateFile(parentId, dst, src);
 		else
+			PutFile(parentId, dst, src);
+	}
+
+	void Session::PutFile(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src)
+	{
+		using namespace mtp;
+		auto stream = std::make_shared<ObjectInputStream>(src);
+		stream->SetTotal(stream->GetSize());
+
+		msg::ObjectInfo oi;
+		oi.Filename = GetFilename(dst);
+		oi.ObjectFormat = ObjectFormatFromFilename(src);
+		oi.SetSize(stream->GetSize());
+
+		if (IsInteractive())
+			try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
+
+		_session->SendObjectInfo(oi, mtp::Session::AnyStorage, parentId);
+		_session->SendObject(stream);
+	}
+
+	void Session::UpdateFile(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src)
+	{
+		mtp::ObjectId objectId;
+		try
+		{ objectId = ResolveObjectChild(parentId, GetFilename(dst)); }
+		catch(const std::exception &)
 		{
-			auto stream = std::make_shared<ObjectInputStream>(src);
-			stream->SetTotal(stream->GetSize());
+			PutFile(parentId, dst, src);
+			return;
+		}
+		mtp::ObjectFormat format = static_cast<mtp::ObjectFormat>(_session->GetObjectIntegerProperty(objectId, mtp::ObjectProperty::ObjectFormat));
+		if (format == mtp::ObjectFormat::Association)
+			throw std::runtime_error(dst + " is a directory, cannot update it with file " + src);
+
+		auto stream = std::make_shared<ObjectInputStream>(src);
+		stream->SetTotal(stream->GetSize());
+		if (IsInteractive())
+			try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
+
+		if (mtp::Session::UpdateObject(_session, objectId, stream))
+			return;
+
+		mtp::debug("cannot append to ", dst, ", replacing it");
+		_session->DeleteObject(objectId);
+		PutFile(parentId, dst, src);
+	}
+
+	void Session::PutFileResumable(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src)
+	{
+		using namespace mtp;
+		if (!_session->EditObjectSupported())
+		{
+			error("device does not support object editing, uploading ", src, " from the beginning");
+			PutFile(parentId, dst, src);
+			return;
+		}
+
+		std::string filename = GetFilename(dst);
+		TransferJournal journal(TransferJournal::GetUploadPath(src));
+		TransferJournal::Record record = TransferJournal::GetFileRecord(src);
+		record.Parent = parentId;
+
+		TransferJournal::Record saved;
+		bool resume = false;
+		if (journal.Load(saved))
+		{
+			record.ObjectId = saved.ObjectId;
+			record.Storage = saved.Storage;
+			if (saved.SameObject(record) && saved.Parent == parentId)
+			{
+				try
+				{
+					msg::ObjectInfo info = _session->GetObjectInfo(saved.ObjectId);
+					//top-level objects report zero parent instead of root
+					bool sameParent = info.ParentObject == parentId || (parentId == mtp::Session::Root && info.ParentObject == ObjectId(0));
+					if (info.Filename == filename && sameParent && info.StorageId == saved.Storage)
+					{
+						u64 remoteSize = _session->GetObjectIntegerProperty(saved.ObjectId, ObjectProperty::ObjectSize);
+						record.Offset = std::min(saved.Offset, remoteSize);
+						resume = true;
+					}
+				}
+				catch(const InvalidResponseException &ex)
+				{ debug("journalled object is gone: ", ex.what()); }
+			}
+		}
 
+		if (resume)
+			print("resuming ", src, " from ", record.Offset, " of ", record.Size);
+		else
+		{
 			msg::ObjectInfo oi;
-			oi.Filename = GetFilename(dst);
+			oi.Filename = filename;
 			oi.ObjectFormat = ObjectFormatFromFilename(src);
-			oi.SetSize(stream->GetSize());
+			mtp::Session::NewObjectInfo noi = _session->SendObjectInfo(oi, mtp::Session::AnyStorage, parentId);
+			record.ObjectId = noi.ObjectId;
+			record.Storage = noi.StorageId;
+			_session->SendObject(std::make_shared<ByteArrayObjectInputStream>(ByteArray()));
+			record.Offset = 0;
+		}
 
-			if (IsInteractive())
-				try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
+		bool journalled = true;
+		auto checkpoint = [&](u64 offset)
+		{
+			record.Offset = offset;
+			if (!journalled)
+				return;
+			try
+			{ journal.Save(record); }
+			catch(const std::exception &ex)
+			{
+				error("cannot write upload journal: ", ex.what(), ", upload of ", src, " will not be resumable");
+				journalled = false;
+			}
+		};
+		checkpoint(record.Offset);
 
-			_session->SendObjectInfo(oi, mtp::Session::AnyStorage, parentId);
-			_session->SendObject(stream);
+		auto stream = std::make_shared<ObjectInputStream>(src);
+		stream->Seek(record.Offset);
+		if (IsInteractive())
+		{
+			stream->SetTotal(record.Size, record.Offset);
+			try { stream->SetProgressReporter(ProgressBar(dst, _terminalWidth / 3, _terminalWidth)); } catch(const std::exception &ex) { }
+		}
+
+		{
+			mtp::Session::ObjectEditSession edit(_session, record.ObjectId);
+			edit.Truncate(record.Offset);
+			edit.Send(record.Offset, stream, checkpoint);
 		}
+		journal.Remove();
 	}
 
 	void Session::MakeDirectory(mtp::ObjectId parentId, const std::string & name)
@@ -34,6 +34,8 @@ namespace cli
 {
 	class Session
 	{
+		enum class PutMode { Create, Resume, Update };
+
 		mtp::DevicePtr				_device;
 		mtp::SessionPtr				_session;
 		mtp::msg::DeviceInfo		_gdi;
@@ -76,10 +78,15 @@ namespace cli
 		void List(mtp::ObjectId parent, bool extended);
 
 		void ListStorages();
-		void Get(const LocalPath &dst, mtp::ObjectId srcId);
-		void Get(const mtp::ObjectId srcId);
+		void Get(const LocalPath &dst, mtp::ObjectId srcId, bool resume = false);
+		void Get(const mtp::ObjectId srcId, bool resume = false);
+		void GetFile(const LocalPath &dst, mtp::ObjectId srcId);
+		void GetFileResumable(const LocalPath &dst, mtp::ObjectId srcId);
 		void Cat(const Path &path);
-		void Put(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src);
+		void Put(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src, PutMode mode = PutMode::Create);
+		void PutFile(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src);
+		void PutFileResumable(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src);
+		void UpdateFile(mtp::ObjectId parentId, const std::string &dst, const LocalPath &src);
 		void MakeDirectory(mtp::ObjectId parentId, const std::string & name);
 		void ListProperties(mtp::ObjectId id);
 		void ListDeviceProperties();
@@ -105,12 +112,25 @@ namespace cli
 			Put(parent, filename, src);
 		}
 
+		void Put(const LocalPath &src, const Path &dst, PutMode mode)
+		{
+			std::string filename;
+			mtp::ObjectId parent = ResolvePath(dst, filename);
+			Put(parent, filename, src, mode);
+		}
+
 		void Get(const Path &src)
 		{ Get(Resolve(src)); }
 
 		void Get(const LocalPath &dst, const Path &src)
 		{ Get(dst, Resolve(src)); }
 
+		void GetResumable(const Path &src)
+		{ Get(Resolve(src), true); }
+
+		void GetResumable(const LocalPath &dst, const Path &src)
+		{ Get(dst, Resolve(src), true); }
+
 		void MakeDirectory(const std::string &path)
 		{
 			std::string name;
@@ -0,0 +1,222 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "ObjectCache.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+namespace fs
+{
+	template<typename Record>
+	const Record * ObjectTable<Record>::Find(mtp::u32 id) const
+	{
+		if (_slots.empty() || id == 0)
+			return NULL;
+		for(size_t slot = GetSlot(id); ; slot = (slot + 1) & (_slots.size() - 1))
+		{
+			const Record &record = _slots[slot];
+			if (record.Id == id)
+				return &record;
+			if (record.Id == 0)
+				return NULL;
+		}
+	}
+
+	template<typename Record>
+	Record & ObjectTable<Record>::Get(mtp::u32 id)
+	{
+		if (id == 0)
+			throw std::runtime_error("invalid object id 0 in object table");
+		if ((_size + 1) * 10 > _slots.size() * 7) //load factor 0.7
+			Rehash(_slots.empty()? 64: _slots.size() * 2);
+
+		size_t slot = GetSlot(id);
+		while(_slots[slot].Id != id && _slots[slot].Id != 0)
+			slot = (slot + 1) & (_slots.size() - 1);
+
+		Record &record = _slots[slot];
+		if (record.Id == 0)
+		{
+			record = Record();
+			record.Id = id;
+			++_size;
+		}
+		return record;
+	}
+
+	template<typename Record>
+	bool ObjectTable<Record>::Erase(mtp::u32 id)
+	{
+		if (_slots.empty() || id == 0)
+			return false;
+
+		size_t mask = _slots.size() - 1;
+		size_t slot = GetSlot(id);
+		while(_slots[slot].Id != id)
+		{
+			if (_slots[slot].Id == 0)
+				return false;
+			slot = (slot + 1) & mask;
+		}
+
+		//backward shift deletion: move following entries of the probe sequence into the hole
+		size_t hole = slot;
+		for(size_t next = (hole + 1) & mask; _slots[next].Id != 0; next = (next + 1) & mask)
+		{
+			size_t home = GetSlot(_slots[next].Id);
+			if (((next - home) & mask) >= ((next - hole) & mask))
+			{
+				_slots[hole] = _slots[next];
+				hole = next;
+			}
+		}
+		_slots[hole].Id = 0;
+		--_size;
+		return true;
+	}
+
+	template<typename Record>
+	void ObjectTable<Record>::Clear()
+	{
+		std::vector<Record>().swap(_slots);
+		_size = 0;
+	}
+
+	template<typename Record>
+	void ObjectTable<Record>::Rehash(size_t capacity)
+	{
+		std::vector<Record> slots(capacity, Record());
+		slots.swap(_slots);
+		for(auto &record : slots)
+		{
+			if (record.Id == 0)
+				continue;
+			size_t slot = GetSlot(record.Id);
+			while(_slots[slot].Id != 0)
+				slot = (slot + 1) & (_slots.size() - 1);
+			_slots[slot] = record;
+		}
+	}
+
+	template class ObjectTable<ObjectAttributes>;
+	template class ObjectTable<ObjectLocation>;
+
+	int DirectoryEntries::Compare(const Entry &entry, const std::string &name) const
+	{
+		int r = memcmp(_names.data() + entry.NameOffset, name.data(), std::min<size_t>(entry.NameSize, name.size()));
+		if (r != 0)
+			return r;
+		return entry.NameSize < name.size()? -1: entry.NameSize > name.size()? 1: 0;
+	}
+
+	std::vector<DirectoryEntries::Entry>::iterator DirectoryEntries::LowerBound(const std::string &name)
+	{ return std::lower_bound(_entries.begin(), _entries.end(), name, [this](const Entry &entry, const std::string &name) { return Compare(entry, name) < 0; }); }
+
+	std::vector<DirectoryEntries::Entry>::const_iterator DirectoryEntries::LowerBound(const std::string &name) const
+	{ return std::lower_bound(_entries.begin(), _entries.end(), name, [this](const Entry &entry, const std::string &name) { return Compare(entry, name) < 0; }); }
+
+	DirectoryEntries::Entry DirectoryEntries::MakeEntry(const std::string &name, mtp::u64 inode)
+	{
+		Entry entry;
+		entry.NameOffset = _names.size();
+		entry.NameSize = name.size();
+		entry.Inode = inode;
+		_names.insert(_names.end(), name.begin(), name.end());
+		return entry;
+	}
+
+	void DirectoryEntries::Reserve(size_t entries, size_t namesSize)
+	{
+		_entries.reserve(entries);
+		_names.reserve(namesSize);
+	}
+
+	bool DirectoryEntries::Find(const std::string &name, mtp::u64 &inode) const
+	{
+		auto i = LowerBound(name);
+		if (i == _entries.end() || Compare(*i, name) != 0)
+			return false;
+		inode = i->Inode;
+		return true;
+	}
+
+	size_t DirectoryEntries::UpperBound(const std::string &name) const
+	{
+		auto i = LowerBound(name);
+		if (i != _entries.end() && Compare(*i, name) == 0)
+			++i;
+		return std::distance(_entries.begin(), i);
+	}
+
+	bool DirectoryEntries::Insert(const std::string &name, mtp::u64 inode)
+	{
+		auto i = LowerBound(name);
+		if (i != _entries.end() && Compare(*i, name) == 0)
+			return false;
+		size_t index = std::distance(_entries.begin(), i);
+		Entry entry = MakeEntry(name, inode);
+		_entries.insert(_entries.begin() + index, entry);
+		return true;
+	}
+
+	void DirectoryEntries::Set(const std::string &name, mtp::u64 inode)
+	{
+		auto i = LowerBound(name);
+		if (i != _entries.end() && Compare(*i, name) == 0)
+			i->Inode = inode;
+		else
+			Insert(name, inode);
+	}
+
+	bool DirectoryEntries::Erase(const std::string &name)
+	{
+		auto i = LowerBound(name);
+		if (i == _entries.end() || Compare(*i, name) != 0)
+			return false;
+		_garbage += i->NameSize;
+		_entries.erase(i);
+		if (_garbage > 4096 && _garbage * 2 > _names.size())
+			Compact();
+		return true;
+	}
+
+	void DirectoryEntries::Clear()
+	{
+		std::vector<char>().swap(_names);
+		std::vector<Entry>().swap(_entries);
+		_garbage = 0;
+	}
+
+	void DirectoryEntries::Compact()
+	{
+		std::vector<char> names;
+		names.reserve(_names.size() - _garbage);
+		for(auto &entry : _entries)
+		{
+			size_t offset = names.size();
+			names.insert(names.end(), _names.begin() + entry.NameOffset, _names.begin() + entry.NameOffset + entry.NameSize);
+			entry.NameOffset = offset;
+		}
+		_names.swap(names);
+		_garbage = 0;
+	}
+}
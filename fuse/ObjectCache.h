@@ -0,0 +1,137 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AFT_FUSE_OBJECTCACHE_H
+#define	AFT_FUSE_OBJECTCACHE_H
+
+#include <mtp/types.h>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+	struct ObjectAttributes //! cached attributes of object, 32 bytes
+	{
+		mtp::u32	Id; //0 marks empty slot
+		mtp::u32	Mode;
+		mtp::u64	Size;
+		mtp::s64	Mtime;
+		mtp::s64	Ctime;
+	};
+
+	struct ObjectLocation //! parent of object, 12 bytes
+	{
+		mtp::u32	Id; //0 marks empty slot
+		mtp::u32	Parent; //mtp::Session::Root for objects in storage root
+		mtp::u32	Storage; //inode of storage, set for objects in storage root only
+	};
+
+	template<typename Record>
+	class ObjectTable //! open addressing hash table of records keyed by object id
+	{
+		std::vector<Record>	_slots;
+		size_t				_size;
+
+		size_t GetSlot(mtp::u32 id) const
+		{
+			mtp::u32 hash = id * 2654435761u;
+			return (hash ^ (hash >> 16)) & (_slots.size() - 1);
+		}
+
+		void Rehash(size_t capacity);
+
+	public:
+		ObjectTable(): _size(0) { }
+
+		const Record * Find(mtp::u32 id) const;
+
+		Record * Find(mtp::u32 id)
+		{ return const_cast<Record *>(static_cast<const ObjectTable *>(this)->Find(id)); }
+
+		///returns existing or zero-initialised record, reference is valid until next insertion
+		Record & Get(mtp::u32 id);
+		bool Erase(mtp::u32 id);
+		void Clear();
+
+		size_t Size() const
+		{ return _size; }
+
+		size_t GetMemoryUsage() const
+		{ return _slots.capacity() * sizeof(Record); }
+	};
+
+	typedef ObjectTable<ObjectAttributes> AttributeTable;
+	typedef ObjectTable<ObjectLocation> LocationTable;
+
+	class DirectoryEntries //! directory children sorted by name, names are stored in per-directory arena
+	{
+		struct Entry
+		{
+			mtp::u32	NameOffset;
+			mtp::u32	NameSize;
+			mtp::u64	Inode;
+		};
+
+		std::vector<char>	_names;
+		std::vector<Entry>	_entries;
+		size_t				_garbage; //bytes of erased names left in arena
+
+		int Compare(const Entry &entry, const std::string &name) const;
+		std::vector<Entry>::iterator LowerBound(const std::string &name);
+		std::vector<Entry>::const_iterator LowerBound(const std::string &name) const;
+		Entry MakeEntry(const std::string &name, mtp::u64 inode);
+		void Compact();
+
+	public:
+		DirectoryEntries(): _garbage(0) { }
+
+		void Reserve(size_t entries, size_t namesSize);
+
+		bool Find(const std::string &name, mtp::u64 &inode) const;
+
+		///returns index of first entry sorted after name
+		size_t UpperBound(const std::string &name) const;
+
+		///adds entry if name does not exist yet
+		bool Insert(const std::string &name, mtp::u64 inode);
+
+		///adds or replaces entry
+		void Set(const std::string &name, mtp::u64 inode);
+		bool Erase(const std::string &name);
+		void Clear();
+
+		size_t Size() const
+		{ return _entries.size(); }
+
+		bool Empty() const
+		{ return _entries.empty(); }
+
+		std::string GetName(size_t index) const
+		{ const Entry &entry = _entries[index]; return std::string(_names.data() + entry.NameOffset, entry.NameSize); }
+
+		mtp::u64 GetInode(size_t index) const
+		{ return _entries[index].Inode; }
+
+		size_t GetMemoryUsage() const
+		{ return sizeof(*this) + _names.capacity() + _entries.capacity() * sizeof(Entry); }
+	};
+}
+
+#endif
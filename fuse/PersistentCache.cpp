@@ -0,0 +1,396 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "PersistentCache.h"
+#include <mtp/CacheDirectory.h>
+#include <mtp/log.h>
+
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs
+{
+	std::string GetCachePath(const std::string &serial, const std::string &suffix)
+	{
+		std::string dir = mtp::GetCacheDirectory();
+		if (dir.empty())
+			return dir;
+
+		std::string name(serial.empty()? "unknown": serial);
+		for(auto &c : name)
+			if (!isalnum(static_cast<unsigned char>(c)))
+				c = '_';
+		return dir + "/" + name + suffix;
+	}
+
+	//file layout: header, directory records sorted by key, object records grouped by directory, names
+	//records are 8-byte aligned and stored in host byte order, file written on other host is rejected by magic check
+
+	struct PersistentCache::Header
+	{
+		char		Magic[8];
+		mtp::u32	Version;
+		mtp::u32	Directories;
+		mtp::u32	Objects;
+		mtp::u32	NamesSize;
+	};
+
+	struct PersistentCache::DirectoryRecord
+	{
+		mtp::u32	StorageId;
+		mtp::u32	PersistentIdLength;
+		mtp::u8		PersistentId[PersistentIdSize];
+		mtp::u32	FirstObject;
+		mtp::u32	Objects;
+	};
+
+	struct PersistentCache::ObjectRecord
+	{
+		mtp::u8		PersistentId[PersistentIdSize];
+		mtp::u64	Size;
+		mtp::s64	Mtime;
+		mtp::s64	Ctime;
+		mtp::u32	Mode;
+		mtp::u32	NameOffset;
+		mtp::u32	NameSize;
+		mtp::u32	Reserved;
+	};
+
+	namespace
+	{
+		const char		Magic[8] = { 'A', 'F', 'T', 'C', 'A', 'C', 'H', 'E' };
+		const mtp::u32	Version = 1;
+	}
+
+	PersistentCache::PersistentCache(): _data(NULL), _size(0), _header(NULL)
+	{ }
+
+	PersistentCache::~PersistentCache()
+	{
+		try { Close(); } catch(const std::exception &ex) { mtp::error("saving cache failed: ", ex.what()); }
+	}
+
+	void PersistentCache::Open(const std::string &path)
+	{
+		Close();
+		_path = path;
+		Map();
+	}
+
+	void PersistentCache::Close()
+	{
+		if (!IsOpen())
+			return;
+		Save();
+		Unmap();
+		_path.clear();
+	}
+
+	void PersistentCache::Map()
+	{
+		Unmap();
+		int fd = open(_path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header))
+		{
+			void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				_data = static_cast<const mtp::u8 *>(data);
+				_size = st.st_size;
+			}
+			else
+				mtp::error("mmap of ", _path, " failed: ", strerror(errno));
+		}
+		close(fd);
+		if (!_data)
+			return;
+
+		const Header *header = reinterpret_cast<const Header *>(_data);
+		size_t size = sizeof(Header) + (size_t)header->Directories * sizeof(DirectoryRecord) + (size_t)header->Objects * sizeof(ObjectRecord) + header->NamesSize;
+		if (memcmp(header->Magic, Magic, sizeof(Magic)) != 0 || header->Version != Version || size != _size)
+		{
+			mtp::error("ignoring invalid cache file ", _path);
+			Unmap();
+			return;
+		}
+		_header = header;
+		mtp::debug("mapped cache ", _path, ": ", header->Directories, " directories, ", header->Objects, " objects");
+	}
+
+	void PersistentCache::Unmap()
+	{
+		if (_data)
+			munmap(const_cast<mtp::u8 *>(_data), _size);
+		_data = NULL;
+		_size = 0;
+		_header = NULL;
+	}
+
+	const PersistentCache::DirectoryRecord * PersistentCache::Find(const Key &key) const
+	{
+		if (!_header)
+			return NULL;
+
+		const DirectoryRecord *begin = reinterpret_cast<const DirectoryRecord *>(_header + 1);
+		const DirectoryRecord *end = begin + _header->Directories;
+		const DirectoryRecord *dir = std::lower_bound(begin, end, key, [](const DirectoryRecord &record, const Key &key)
+		{
+			if (record.StorageId != key.StorageId)
+				return record.StorageId < key.StorageId;
+			return std::lexicographical_compare(record.PersistentId, record.PersistentId + std::min(size_t(record.PersistentIdLength), size_t(PersistentIdSize)), key.PersistentId.begin(), key.PersistentId.end());
+		});
+		if (dir == end || dir->StorageId != key.StorageId || dir->PersistentIdLength != key.PersistentId.size() ||
+			!std::equal(key.PersistentId.begin(), key.PersistentId.end(), dir->PersistentId))
+			return NULL;
+		return IsValid(*dir)? dir: NULL;
+	}
+
+	const PersistentCache::ObjectRecord * PersistentCache::GetObjects() const
+	{ return reinterpret_cast<const ObjectRecord *>(reinterpret_cast<const DirectoryRecord *>(_header + 1) + _header->Directories); }
+
+	const char * PersistentCache::GetNames() const
+	{ return reinterpret_cast<const char *>(GetObjects() + _header->Objects); }
+
+	bool PersistentCache::IsValid(const DirectoryRecord &dir) const
+	{
+		if (dir.PersistentIdLength > PersistentIdSize || (size_t)dir.FirstObject + dir.Objects > _header->Objects)
+			return false;
+		for(const ObjectRecord *object = GetObjects() + dir.FirstObject, *end = object + dir.Objects; object != end; ++object)
+			if ((size_t)object->NameOffset + object->NameSize > _header->NamesSize)
+				return false;
+		return true;
+	}
+
+	bool PersistentCache::Get(const Key &key, Entries &entries) const
+	{
+		entries.clear();
+		auto change = _changes.find(key);
+		if (change != _changes.end())
+		{
+			if (!change->second)
+				return false;
+			entries = *change->second;
+			return true;
+		}
+
+		const DirectoryRecord *dir = Find(key);
+		if (!dir)
+			return false;
+
+		const ObjectRecord *objects = GetObjects();
+		const char *names = GetNames();
+		entries.reserve(dir->Objects);
+		for(const ObjectRecord *object = objects + dir->FirstObject, *end = object + dir->Objects; object != end; ++object)
+		{
+			Entry entry;
+			entry.Name.assign(names + object->NameOffset, object->NameSize);
+			entry.PersistentId.assign(object->PersistentId, object->PersistentId + PersistentIdSize);
+			entry.Mode = object->Mode;
+			entry.Size = object->Size;
+			entry.Mtime = object->Mtime;
+			entry.Ctime = object->Ctime;
+			entries.push_back(std::move(entry));
+		}
+		return true;
+	}
+
+	void PersistentCache::Set(const Key &key, const Entries &entries)
+	{
+		if (!IsOpen() || (!key.PersistentId.empty() && key.PersistentId.size() != PersistentIdSize))
+			return;
+		for(auto &entry : entries)
+			if (entry.PersistentId.size() != PersistentIdSize)
+				return;
+
+		_changes[key] = std::make_shared<Entries>(entries);
+		if (_changes.size() >= SaveInterval)
+			Save();
+	}
+
+	void PersistentCache::Invalidate(const Key &key)
+	{
+		if (!IsOpen())
+			return;
+		_changes[key].reset();
+		if (_changes.size() >= SaveInterval)
+			Save();
+	}
+
+	void PersistentCache::Save()
+	{
+		if (!IsOpen() || _changes.empty())
+			return;
+
+		//merge sorted mapped directories with sorted changes
+		struct Directory
+		{
+			const DirectoryRecord *	Record;
+			const Key *				ChangedKey;
+			const Entries *			Changed;
+		};
+		std::vector<Directory> dirs;
+		{
+			const DirectoryRecord *record = _header? reinterpret_cast<const DirectoryRecord *>(_header + 1): NULL;
+			const DirectoryRecord *end = _header? record + _header->Directories: NULL;
+			auto change = _changes.begin();
+			while(record != end || change != _changes.end())
+			{
+				Key key(0);
+				if (record != end)
+				{
+					key.StorageId = record->StorageId;
+					key.PersistentId.assign(record->PersistentId, record->PersistentId + record->PersistentIdLength);
+				}
+				if (change != _changes.end() && (record == end || !(key < change->first)))
+				{
+					if (record != end && !(change->first < key))
+						++record; //replaced
+					if (change->second)
+						dirs.push_back(Directory { NULL, &change->first, change->second.get() });
+					++change;
+				}
+				else
+				{
+					if (IsValid(*record))
+						dirs.push_back(Directory { record, NULL, NULL });
+					++record;
+				}
+			}
+		}
+
+		const ObjectRecord *objects = _header? GetObjects(): NULL;
+		const char *names = _header? GetNames(): NULL;
+
+		Header header = { };
+		memcpy(header.Magic, Magic, sizeof(Magic));
+		header.Version = Version;
+		header.Directories = dirs.size();
+		for(auto &dir : dirs)
+		{
+			if (dir.Changed)
+			{
+				header.Objects += dir.Changed->size();
+				for(auto &entry : *dir.Changed)
+					header.NamesSize += entry.Name.size();
+			}
+			else
+			{
+				header.Objects += dir.Record->Objects;
+				for(const ObjectRecord *object = objects + dir.Record->FirstObject, *end = object + dir.Record->Objects; object != end; ++object)
+					header.NamesSize += object->NameSize;
+			}
+		}
+
+		std::string tmp = _path + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (!f)
+		{
+			mtp::error("cannot write cache ", tmp, ": ", strerror(errno));
+			_changes.clear();
+			return;
+		}
+
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+		mtp::u32 firstObject = 0;
+		for(auto &dir : dirs)
+		{
+			DirectoryRecord record = { };
+			if (dir.Changed)
+			{
+				record.StorageId = dir.ChangedKey->StorageId;
+				record.PersistentIdLength = dir.ChangedKey->PersistentId.size();
+				std::copy(dir.ChangedKey->PersistentId.begin(), dir.ChangedKey->PersistentId.end(), record.PersistentId);
+				record.Objects = dir.Changed->size();
+			}
+			else
+				record = *dir.Record;
+			record.FirstObject = firstObject;
+			firstObject += record.Objects;
+			ok = ok && fwrite(&record, sizeof(record), 1, f) == 1;
+		}
+
+		mtp::u32 nameOffset = 0;
+		for(auto &dir : dirs)
+		{
+			if (dir.Changed)
+			{
+				for(auto &entry : *dir.Changed)
+				{
+					ObjectRecord record = { };
+					std::copy(entry.PersistentId.begin(), entry.PersistentId.end(), record.PersistentId);
+					record.Size = entry.Size;
+					record.Mtime = entry.Mtime;
+					record.Ctime = entry.Ctime;
+					record.Mode = entry.Mode;
+					record.NameOffset = nameOffset;
+					record.NameSize = entry.Name.size();
+					nameOffset += record.NameSize;
+					ok = ok && fwrite(&record, sizeof(record), 1, f) == 1;
+				}
+			}
+			else
+			{
+				for(const ObjectRecord *object = objects + dir.Record->FirstObject, *end = object + dir.Record->Objects; object != end; ++object)
+				{
+					ObjectRecord record = *object;
+					record.NameOffset = nameOffset;
+					nameOffset += record.NameSize;
+					ok = ok && fwrite(&record, sizeof(record), 1, f) == 1;
+				}
+			}
+		}
+
+		for(auto &dir : dirs)
+		{
+			if (dir.Changed)
+			{
+				for(auto &entry : *dir.Changed)
+					ok = ok && fwrite(entry.Name.data(), 1, entry.Name.size(), f) == entry.Name.size();
+			}
+			else
+			{
+				for(const ObjectRecord *object = objects + dir.Record->FirstObject, *end = object + dir.Record->Objects; object != end; ++object)
+					ok = ok && fwrite(names + object->NameOffset, 1, object->NameSize, f) == object->NameSize;
+			}
+		}
+
+		ok = fclose(f) == 0 && ok;
+		_changes.clear();
+		if (!ok || rename(tmp.c_str(), _path.c_str()) != 0)
+		{
+			mtp::error("saving cache ", _path, " failed: ", strerror(errno));
+			unlink(tmp.c_str());
+		}
+		Map();
+	}
+}
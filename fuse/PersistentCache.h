@@ -0,0 +1,105 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AFT_FUSE_PERSISTENTCACHE_H
+#define	AFT_FUSE_PERSISTENTCACHE_H
+
+#include <mtp/types.h>
+#include <mtp/ByteArray.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+	///returns per-device file path in project cache directory, creating directory if needed, empty if there is no home directory
+	std::string GetCachePath(const std::string &serial, const std::string &suffix);
+
+	class PersistentCache //! directory listings persisted across mounts in memory-mapped file, keyed by storage id and persistent unique object id of directory
+	{
+	public:
+		struct Key
+		{
+			mtp::u32		StorageId;
+			mtp::ByteArray	PersistentId; //empty for storage root
+
+			Key(mtp::u32 storageId, const mtp::ByteArray &persistentId = mtp::ByteArray()): StorageId(storageId), PersistentId(persistentId) { }
+
+			bool operator < (const Key &o) const
+			{ return StorageId != o.StorageId? StorageId < o.StorageId: PersistentId < o.PersistentId; }
+		};
+
+		struct Entry
+		{
+			std::string		Name;
+			mtp::ByteArray	PersistentId;
+			mtp::u32		Mode;
+			mtp::u64		Size;
+			mtp::s64		Mtime;
+			mtp::s64		Ctime;
+		};
+		typedef std::vector<Entry> Entries;
+		typedef std::shared_ptr<Entries> EntriesPtr;
+
+		static const size_t PersistentIdSize = 16;
+
+	private:
+		struct Header;
+		struct DirectoryRecord;
+		struct ObjectRecord;
+
+		std::string				_path;
+		const mtp::u8 *			_data;
+		size_t					_size;
+		const Header *			_header;
+
+		typedef std::map<Key, EntriesPtr> Changes; //null entries remove directory
+		Changes					_changes;
+		static const size_t		SaveInterval = 64;
+
+		void Map();
+		void Unmap();
+		const DirectoryRecord * Find(const Key &key) const;
+		const ObjectRecord * GetObjects() const;
+		const char * GetNames() const;
+		bool IsValid(const DirectoryRecord &dir) const;
+
+	public:
+		PersistentCache();
+		~PersistentCache();
+
+		bool IsOpen() const
+		{ return !_path.empty(); }
+
+		///maps cache file, saving previously opened one
+		void Open(const std::string &path);
+		void Close();
+
+		bool Get(const Key &key, Entries &entries) const;
+		void Set(const Key &key, const Entries &entries);
+		void Invalidate(const Key &key);
+
+		///merges pending changes into new file and replaces mapped one atomically
+		void Save();
+	};
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "Statistics.h"
+
+#include <stdio.h>
+
+namespace fs
+{
+	Statistics::Statistics(): BytesRead(0), BytesWritten(0), MergedReads(0)
+	{
+		for(auto &counter : _counters)
+		{
+			counter.Count = 0;
+			counter.Time = 0;
+			counter.MaxTime = 0;
+		}
+	}
+
+	const char * Statistics::GetName(Operation op)
+	{
+		static const char *names[OperationCount] =
+		{
+			"lookup", "getattr", "setattr", "opendir", "readdir", "releasedir", "open", "read", "write", "flush", "fsync", "release",
+			"create", "mknod", "mkdir", "rmdir", "unlink", "rename", "statfs", "getxattr"
+		};
+		return op < OperationCount? names[op]: "unknown";
+	}
+
+	void Statistics::Add(Operation op, std::chrono::steady_clock::duration time)
+	{
+		if (op >= OperationCount)
+			return;
+		mtp::u64 us = std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+		Counter &counter = _counters[op];
+		++counter.Count;
+		counter.Time += us;
+		mtp::u64 max = counter.MaxTime.load();
+		while(us > max && !counter.MaxTime.compare_exchange_weak(max, us))
+			;
+	}
+
+	std::string Statistics::Format() const
+	{
+		std::string text;
+		char buf[256];
+		snprintf(buf, sizeof(buf), "%-12s %10s %12s %12s %12s\n", "operation", "count", "total ms", "avg us", "max us");
+		text += buf;
+		for(int op = 0; op < OperationCount; ++op)
+		{
+			const Counter &counter = _counters[op];
+			mtp::u64 count = counter.Count.load();
+			if (!count)
+				continue;
+			mtp::u64 time = counter.Time.load();
+			snprintf(buf, sizeof(buf), "%-12s %10llu %12llu %12llu %12llu\n", GetName(static_cast<Operation>(op)),
+				(unsigned long long)count, (unsigned long long)(time / 1000), (unsigned long long)(time / count), (unsigned long long)counter.MaxTime.load());
+			text += buf;
+		}
+		return text;
+	}
+}
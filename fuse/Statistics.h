@@ -0,0 +1,80 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AFT_FUSE_STATISTICS_H
+#define	AFT_FUSE_STATISTICS_H
+
+#include <mtp/types.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace fs
+{
+	class Statistics //! per-operation counters of fuse requests, updated without locks from request threads
+	{
+	public:
+		enum Operation
+		{
+			Lookup, GetAttr, SetAttr, OpenDir, ReadDir, ReleaseDir, Open, Read, Write, Flush, FSync, Release,
+			Create, MakeNode, MakeDir, RemoveDir, Unlink, Rename, StatFS, GetXAttr,
+			OperationCount
+		};
+
+		std::atomic<mtp::u64>	BytesRead;
+		std::atomic<mtp::u64>	BytesWritten;
+		std::atomic<mtp::u64>	MergedReads; //reads served by transaction fetching data for several requests
+
+		Statistics();
+
+		static const char * GetName(Operation op);
+
+		void Add(Operation op, std::chrono::steady_clock::duration time);
+
+		///formats table of operations with non-zero counts
+		std::string Format() const;
+
+	private:
+		struct Counter
+		{
+			std::atomic<mtp::u64>	Count;
+			std::atomic<mtp::u64>	Time; //microseconds
+			std::atomic<mtp::u64>	MaxTime;
+		};
+		Counter		_counters[OperationCount];
+	};
+
+	class OperationTimer //! adds time spent in scope to \ref Statistics
+	{
+		Statistics &							_statistics;
+		Statistics::Operation					_operation;
+		std::chrono::steady_clock::time_point	_started;
+
+	public:
+		OperationTimer(Statistics &statistics, Statistics::Operation op):
+			_statistics(statistics), _operation(op), _started(std::chrono::steady_clock::now())
+		{ }
+
+		~OperationTimer()
+		{ _statistics.Add(_operation, std::chrono::steady_clock::now() - _started); }
+	};
+}
+
+#endif
@@ -0,0 +1,176 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "ThumbnailCache.h"
+#include "PersistentCache.h"
+#include <mtp/log.h>
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace fs
+{
+	std::string ThumbnailCache::GetKey(mtp::u32 id, mtp::u64 size, time_t mtime)
+	{
+		char key[64];
+		snprintf(key, sizeof(key), "%08x-%llx-%llx", (unsigned)id, (unsigned long long)size, (long long)mtime);
+		return key;
+	}
+
+	std::string ThumbnailCache::GetPath(const mtp::ByteArray &persistentId, mtp::u64 size, time_t mtime) const
+	{
+		if (_dir.empty() || persistentId.empty())
+			return std::string();
+		std::string path = _dir + "/";
+		char buf[64];
+		for(mtp::u8 byte : persistentId)
+		{
+			snprintf(buf, sizeof(buf), "%02x", byte);
+			path += buf;
+		}
+		snprintf(buf, sizeof(buf), "-%llx-%llx", (unsigned long long)size, (long long)mtime);
+		return path + buf;
+	}
+
+	void ThumbnailCache::Open(const std::string &serial)
+	{
+		_lastKey.clear();
+		_lastData.clear();
+		_total = 0;
+		_dir = GetCachePath(serial, ".thumbnails");
+		if (_dir.empty())
+			return;
+		if (mkdir(_dir.c_str(), 0700) != 0 && errno != EEXIST)
+		{
+			mtp::error("cannot create thumbnail cache ", _dir, ": ", strerror(errno));
+			_dir.clear();
+			return;
+		}
+		Trim();
+	}
+
+	void ThumbnailCache::Trim()
+	{
+		DIR *dir = opendir(_dir.c_str());
+		if (!dir)
+			return;
+
+		std::vector<std::pair<time_t, std::string>> files; //by last use, Get touches files it hits
+		size_t total = 0;
+		while(struct dirent *entry = readdir(dir))
+		{
+			if (entry->d_name[0] == '.')
+				continue;
+			std::string path = _dir + "/" + entry->d_name;
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+				continue;
+			total += st.st_size;
+			files.push_back(std::make_pair(st.st_mtime, path));
+		}
+		closedir(dir);
+
+		_total = total;
+		if (total <= _limit)
+			return;
+		std::sort(files.begin(), files.end());
+		size_t removed = 0;
+		for(auto &file : files)
+		{
+			if (total <= _limit / 4 * 3)
+				break;
+			struct stat st;
+			if (stat(file.second.c_str(), &st) == 0 && unlink(file.second.c_str()) == 0)
+			{
+				total -= std::min<size_t>(total, st.st_size);
+				++removed;
+			}
+		}
+		_total = total;
+		mtp::debug("removed ", removed, " cached thumbnails, ", total / 1024, " KiB left");
+	}
+
+	bool ThumbnailCache::Get(mtp::u32 id, const mtp::ByteArray &persistentId, mtp::u64 size, time_t mtime, mtp::ByteArray &data)
+	{
+		std::string key = GetKey(id, size, mtime);
+		if (key == _lastKey)
+		{
+			data = _lastData;
+			return true;
+		}
+
+		std::string path = GetPath(persistentId, size, mtime);
+		if (path.empty())
+			return false;
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		struct stat st;
+		bool ok = fstat(fileno(f), &st) == 0;
+		if (ok)
+		{
+			data.resize(st.st_size);
+			ok = data.empty() || fread(data.data(), 1, data.size(), f) == data.size();
+		}
+		fclose(f);
+		if (!ok)
+			return false;
+
+		utimes(path.c_str(), NULL); //marks thumbnail as recently used for Trim
+		_lastKey = key;
+		_lastData = data;
+		return true;
+	}
+
+	void ThumbnailCache::Put(mtp::u32 id, const mtp::ByteArray &persistentId, mtp::u64 size, time_t mtime, const mtp::ByteArray &data)
+	{
+		_lastKey = GetKey(id, size, mtime);
+		_lastData = data;
+
+		std::string path = GetPath(persistentId, size, mtime);
+		if (path.empty())
+			return;
+		std::string tmp = path + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (!f)
+		{
+			mtp::error("cannot write thumbnail ", tmp, ": ", strerror(errno));
+			return;
+		}
+		bool ok = data.empty() || fwrite(data.data(), 1, data.size(), f) == data.size();
+		ok = fclose(f) == 0 && ok;
+		if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+		{
+			unlink(tmp.c_str());
+			return;
+		}
+		_total += data.size();
+		if (_total > _limit)
+			Trim();
+	}
+}
@@ -0,0 +1,59 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AFT_FUSE_THUMBNAILCACHE_H
+#define	AFT_FUSE_THUMBNAILCACHE_H
+
+#include <mtp/ByteArray.h>
+#include <mtp/types.h>
+#include <string>
+#include <time.h>
+
+namespace fs
+{
+	class ThumbnailCache //! device-generated thumbnails stored one file per object in cache directory, keyed by persistent unique object id, size and mtime
+	{
+		std::string		_dir;
+		size_t			_limit;
+		size_t			_total; //bytes in cache directory, Put trims once it passes the limit
+
+		std::string		_lastKey; //getxattr asks for size first, then for contents
+		mtp::ByteArray	_lastData;
+
+		static std::string GetKey(mtp::u32 id, mtp::u64 size, time_t mtime);
+		std::string GetPath(const mtp::ByteArray &persistentId, mtp::u64 size, time_t mtime) const;
+		void Trim();
+
+	public:
+		static const size_t DefaultLimit = 64 * 1024 * 1024;
+
+		ThumbnailCache(size_t limit = DefaultLimit): _limit(limit), _total(0) { }
+
+		///selects cache directory of device, removing oldest thumbnails over size limit
+		void Open(const std::string &serial);
+
+		///returns true if object was seen before, empty data means device has no thumbnail for it
+		///only the last thumbnail is kept if device has no persistent ids, object ids are not stable across sessions
+		bool Get(mtp::u32 id, const mtp::ByteArray &persistentId, mtp::u64 size, time_t mtime, mtp::ByteArray &data);
+		void Put(mtp::u32 id, const mtp::ByteArray &persistentId, mtp::u64 size, time_t mtime, const mtp::ByteArray &data);
+	};
+}
+
+#endif
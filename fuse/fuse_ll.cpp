@@ -18,19 +18,41 @@
  */
 
 #include <fuse_lowlevel.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <mtp/ptp/Device.h>
 #include <mtp/ptp/ByteArrayObjectStream.h>
 #include <mtp/usb/DeviceNotFoundException.h>
+#include <mtp/usb/TimeoutException.h>
 #include <mtp/ptp/ObjectPropertyListParser.h>
+#include <mtp/ptp/Response.h>
 #include <mtp/log.h>
 
+#include "ObjectCache.h"
+#include "PersistentCache.h"
+#include "Statistics.h"
+#include "ThumbnailCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <map>
 #include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 namespace
 {
@@ -47,10 +69,20 @@ namespace
 		}
 	};
 
+#ifndef RENAME_NOREPLACE
+#	define RENAME_NOREPLACE (1 << 0)
+#endif
+
 #define FUSE_CALL(...) do { int _r = __VA_ARGS__ ; if (_r < 0) throw Exception(#__VA_ARGS__ " failed", -_r); } while(false)
 
 	typedef std::vector<char> CharArray;
 
+#if FUSE_USE_VERSION >= 30
+	typedef struct fuse_session NotifyChannel; //target of fuse_lowlevel_notify_* calls
+#else
+	typedef struct fuse_chan NotifyChannel;
+#endif
+
 	struct FuseId
 	{
 		static const FuseId Root;
@@ -72,6 +104,7 @@ namespace
 	struct FuseEntry : fuse_entry_param
 	{
 		static constexpr const double	Timeout = 60.0;
+		static constexpr const double	NegativeTimeout = 60.0; //names appear only through this mount, kernel replaces negative entry on create
 		static constexpr unsigned 		FileMode 		= S_IFREG | 0444;
 		static constexpr unsigned 		DirectoryMode	= S_IFDIR | 0755;
 
@@ -124,60 +157,730 @@ namespace
 		{
 			FUSE_CALL(fuse_reply_err(Request, err));
 		}
+
+		///replies ENOENT letting kernel cache missing name
+		void ReplyNegative()
+		{
+			ino = 0;
+			attr_timeout = 0;
+			entry_timeout = NegativeTimeout;
+			FUSE_CALL(fuse_reply_entry(Request, this));
+		}
 	};
 
-	struct FuseDirectory
+	class FuseDirectory //! readdir reply buffer bounded by requested size, carries entry attributes for readdirplus
 	{
-		fuse_req_t			Request;
+		fuse_req_t			_request;
+		CharArray			_data;
+		size_t				_size;
+		bool				_plus;
 
-		FuseDirectory(fuse_req_t request): Request(request) { }
+	public:
+		FuseDirectory(fuse_req_t request, size_t size, bool plus): _request(request), _size(size), _plus(plus)
+		{ _data.reserve(size); }
 
-		void Add(CharArray & data, const std::string &name, const struct stat & entry)
+		///adds entry with cookie of the next one, returns false if it does not fit. only inode and type are used from attributes which are not valid
+		bool Add(const std::string &name, const struct stat &attr, bool valid, off_t next)
 		{
-			if (data.empty())
-				data.reserve(4096);
-			size_t size = fuse_add_direntry(Request, NULL, 0, name.c_str(), NULL, 0);
-			size_t offset = data.size();
-			data.resize(data.size() + size);
-			fuse_add_direntry(Request, data.data() + offset, size, name.c_str(), &entry, data.size()); //request is not used inside fuse here, so we could cache resulting dirent data
+			size_t offset = _data.size();
+#if FUSE_USE_VERSION >= 30
+			if (_plus)
+			{
+				fuse_entry_param entry = { };
+				entry.attr = attr;
+				if (valid) //zero inode makes kernel skip instantiating entry
+				{
+					entry.ino = attr.st_ino;
+					entry.generation = 1;
+					entry.attr_timeout = entry.entry_timeout = FuseEntry::Timeout;
+				}
+				size_t size = fuse_add_direntry_plus(_request, NULL, 0, name.c_str(), NULL, 0);
+				if (offset + size > _size)
+					return false;
+				_data.resize(offset + size);
+				fuse_add_direntry_plus(_request, _data.data() + offset, size, name.c_str(), &entry, next);
+				return true;
+			}
+#endif
+			size_t size = fuse_add_direntry(_request, NULL, 0, name.c_str(), NULL, 0);
+			if (offset + size > _size)
+				return false;
+			_data.resize(offset + size);
+			fuse_add_direntry(_request, _data.data() + offset, size, name.c_str(), &attr, next);
+			return true;
+		}
+
+		fuse_req_t GetRequest() const
+		{ return _request; }
+
+		void Reply()
+		{ FUSE_CALL(fuse_reply_buf(_request, _data.empty()? NULL: _data.data(), _data.size())); }
+	};
+
+	struct DirectoryStream //! readdir position of open directory, referenced by fuse_file_info::fh
+	{
+		static const off_t				FirstEntryCookie = 3; //after "." and ".."
+
+		unsigned						Generation;
+		off_t							Offset;			//cookie of last returned entry
+		std::string						LastName;		//name of last returned entry, resumes listing even if directory has changed
+
+		//directories enumerated with GetObjectInfo are listed in device order while objects are being fetched
+		bool							Enumerating;
+		std::vector<mtp::ObjectId>		Handles;
+		size_t							Fetched;
+		std::vector<std::pair<std::string, FuseId>>	Entries;
+		std::map<std::string, FuseId>	Children;
+		std::map<mtp::ObjectId, struct stat>	Attrs;
+
+		DirectoryStream(unsigned generation): Generation(generation)
+		{ Reset(generation); }
+
+		void Reset(unsigned generation)
+		{
+			Generation = generation;
+			Offset = 0;
+			LastName.clear();
+			Enumerating = false;
+			Handles.clear();
+			Fetched = 0;
+			Entries.clear();
+			Children.clear();
+			Attrs.clear();
+		}
+	};
+
+	class SharedMutex //! pthread reader-writer lock, std::shared_mutex is not available in c++11
+	{
+		pthread_rwlock_t	_lock;
+
+	public:
+		SharedMutex()
+		{
+			int r = pthread_rwlock_init(&_lock, NULL);
+			if (r != 0)
+				throw Exception("pthread_rwlock_init", r);
+		}
+		~SharedMutex()
+		{ pthread_rwlock_destroy(&_lock); }
+
+		void lock()
+		{ pthread_rwlock_wrlock(&_lock); }
+		void unlock()
+		{ pthread_rwlock_unlock(&_lock); }
+		void lock_shared()
+		{ pthread_rwlock_rdlock(&_lock); }
+		void unlock_shared()
+		{ pthread_rwlock_unlock(&_lock); }
+	};
+
+	class SharedLock //! scoped shared ownership of \ref SharedMutex
+	{
+		SharedMutex &	_mutex;
+
+	public:
+		SharedLock(SharedMutex &mutex): _mutex(mutex)
+		{ _mutex.lock_shared(); }
+		~SharedLock()
+		{ _mutex.unlock_shared(); }
+	};
+
+	typedef std::lock_guard<SharedMutex> ExclusiveLock;
+
+	class PipeBuffer //! kernel pipe holding read-ahead data, spliced into fuse replies without passing through user space
+	{
+		int		_fds[2];
+		size_t	_capacity;
+
+		PipeBuffer(const PipeBuffer &);
+		PipeBuffer & operator = (const PipeBuffer &);
+
+	public:
+		off_t	Offset; //file offset of the first byte in pipe
+		size_t	Size; //bytes in pipe
+
+		PipeBuffer(size_t capacity): _capacity(0), Offset(0), Size(0)
+		{
+			if (pipe2(_fds, O_CLOEXEC | O_NONBLOCK) != 0)
+				throw Exception("pipe2");
+			static const int DefaultMaxPipeSize = 1024 * 1024; //default /proc/sys/fs/pipe-max-size for unprivileged users
+			if (fcntl(_fds[1], F_SETPIPE_SZ, static_cast<int>(capacity)) < 0)
+				fcntl(_fds[1], F_SETPIPE_SZ, std::min(static_cast<int>(capacity), DefaultMaxPipeSize));
+			int size = fcntl(_fds[1], F_GETPIPE_SZ);
+			if (size > 0)
+				_capacity = size;
+		}
+
+		~PipeBuffer()
+		{ close(_fds[0]); close(_fds[1]); }
+
+		size_t GetCapacity() const
+		{ return _capacity; }
+
+		int GetReadFd() const
+		{ return _fds[0]; }
+
+		int GetWriteFd() const
+		{ return _fds[1]; }
+
+		bool Contains(off_t begin, size_t size) const
+		{ return begin == Offset && size <= Size; }
+	};
+	DECLARE_PTR(PipeBuffer);
+
+	class PipeOutputStream : public mtp::IObjectOutputStream, public mtp::CancellableStream //! appends object data to \ref PipeBuffer
+	{
+		PipeBufferPtr	_pipe;
+
+	public:
+		PipeOutputStream(const PipeBufferPtr &pipe): _pipe(pipe) { }
+
+		virtual size_t Write(const mtp::u8 *data, size_t size)
+		{
+			CheckCancelled();
+			size_t done = 0;
+			while(done < size)
+			{
+				//pipe is non-blocking, overflowing it throws instead of deadlocking the only reader
+				ssize_t r = write(_pipe->GetWriteFd(), data + done, size - done);
+				if (r < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					throw Exception("write to pipe");
+				}
+				done += r;
+			}
+			_pipe->Size += size;
+			return size;
 		}
+	};
+
+	struct FileHandle //! per open file state, referenced by fuse_file_info::fh
+	{
+		static const size_t MinReadAhead = 256 * 1024;
+		static const size_t DefaultMaxReadAhead = 8 * 1024 * 1024;
+
+		FuseId			Inode;
+		off_t			ReadOffset; //offset of ReadBuffer in file
+		mtp::ByteArray	ReadBuffer;
+		PipeBufferPtr	Pipe; //sequential read-ahead, used instead of ReadBuffer when fuse can splice replies
+		off_t			NextReadOffset; //offset where sequential read would continue
+		size_t			ReadAhead;
 
-		static void Reply(fuse_req_t req, const CharArray &data, off_t off, size_t size)
+		FileHandle(FuseId inode): Inode(inode), ReadOffset(0), NextReadOffset(0), ReadAhead(0) { }
+
+		bool IsBuffered(off_t begin, size_t size) const
+		{ return begin >= ReadOffset && begin + (off_t)size <= ReadOffset + (off_t)ReadBuffer.size(); }
+
+		///returns size of block to fetch for read request, doubling read-ahead window while access is sequential
+		size_t GetFetchSize(off_t begin, size_t size, size_t maxReadAhead)
 		{
-			if (off >= (off_t)data.size())
-				FUSE_CALL(fuse_reply_buf(req, NULL, 0));
+			if (begin == NextReadOffset)
+				ReadAhead = std::min<size_t>(ReadAhead? ReadAhead * 2: size_t(MinReadAhead), maxReadAhead);
 			else
+				ReadAhead = 0;
+			return std::max(size, ReadAhead);
+		}
+
+		void Invalidate()
+		{ ReadBuffer.clear(); ReadOffset = 0; Pipe.reset(); }
+	};
+
+	struct ReadRequest //! kernel read waiting for device, requests arriving while device is busy are merged
+	{
+		fuse_req_t	Request;
+		FuseId		Inode;
+		uint64_t	Handle;
+		size_t		Size;
+		off_t		Offset;
+		bool		Replied;
+		std::chrono::steady_clock::time_point	Queued; //read latency includes time spent waiting for device
+
+		ReadRequest(fuse_req_t req, FuseId inode, uint64_t handle, size_t size, off_t offset):
+			Request(req), Inode(inode), Handle(handle), Size(size), Offset(offset), Replied(false), Queued(std::chrono::steady_clock::now()) { }
+
+		bool operator < (const ReadRequest &o) const
+		{ return Inode.Inode != o.Inode.Inode? Inode.Inode < o.Inode.Inode: Offset < o.Offset; }
+	};
+	typedef std::vector<ReadRequest> ReadRequests;
+
+	struct WriteBuffer //! pending writes of one file merged into contiguous extents
+	{
+		typedef std::map<off_t, mtp::ByteArray> Extents;
+		Extents		Data;
+		size_t		Size; //buffered bytes
+		off_t		RemoteSize; //file size on device
+		off_t		FileSize; //file size after flush
+
+		WriteBuffer(off_t size): Size(0), RemoteSize(size), FileSize(size) { }
+
+		void Add(off_t offset, const char *data, size_t size)
+		{
+			off_t begin = offset, end = offset + size;
+			FileSize = std::max(FileSize, end);
+
+			auto first = Data.upper_bound(offset);
+			if (first != Data.begin())
+			{
+				auto prev = std::prev(first);
+				off_t prevEnd = prev->first + prev->second.size();
+				if (prevEnd == offset && (first == Data.end() || first->first > end))
+				{
+					//fast path for sequential writes
+					prev->second.insert(prev->second.end(), data, data + size);
+					Size += size;
+					return;
+				}
+				if (prevEnd >= offset)
+					first = prev;
+			}
+
+			auto last = first;
+			for(; last != Data.end() && last->first <= end; ++last)
+			{
+				begin = std::min(begin, last->first);
+				end = std::max<off_t>(end, last->first + last->second.size());
+			}
+
+			mtp::ByteArray merged(end - begin);
+			for(auto i = first; i != last; ++i)
+			{
+				std::copy(i->second.begin(), i->second.end(), merged.begin() + (i->first - begin));
+				Size -= i->second.size();
+			}
+			std::copy(data, data + size, merged.begin() + (offset - begin));
+			Data.erase(first, last);
+			Size += merged.size();
+			Data.insert(std::make_pair(begin, std::move(merged)));
+		}
+	};
+
+	class UploadStream : public mtp::IObjectInputStream, public mtp::CancellableStream //! bounded pipe feeding SendObject data phase with sequential writes
+	{
+		static const size_t Capacity = 8 * 1024 * 1024;
+
+		std::mutex					_mutex;
+		std::condition_variable		_cond;
+		mtp::ByteArray				_buffer;
+		size_t						_readOffset;
+		bool						_closed;
+		bool						_failed;
+
+	public:
+		UploadStream(): _readOffset(0), _closed(false), _failed(false) { }
+
+		virtual mtp::u64 GetSize() const
+		{ return mtp::MaxObjectSize; } //unknown size, data phase is terminated by short packet
+
+		virtual void Cancel()
+		{
+			CancellableStream::Cancel();
+			std::unique_lock<std::mutex> l(_mutex);
+			_cond.notify_all();
+		}
+
+		///blocks until the whole block is available, returns less only at the end of stream
+		virtual size_t Read(mtp::u8 *data, size_t size)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			while(!_closed && _buffer.size() - _readOffset < size)
+			{
+				CheckCancelled();
+				_cond.wait(l);
+			}
+			CheckCancelled();
+			size_t n = std::min(size, _buffer.size() - _readOffset);
+			std::copy(_buffer.begin() + _readOffset, _buffer.begin() + _readOffset + n, data);
+			_readOffset += n;
+			if (_readOffset * 2 >= _buffer.size())
+			{
+				_buffer.erase(_buffer.begin(), _buffer.begin() + _readOffset);
+				_readOffset = 0;
+			}
+			_cond.notify_all();
+			return n;
+		}
+
+		void Write(const char *data, size_t size)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			while(size)
+			{
+				while(!_failed && _buffer.size() - _readOffset >= Capacity)
+					_cond.wait(l);
+				if (_failed)
+					throw std::runtime_error("upload failed");
+
+				size_t n = std::min(size, Capacity - (_buffer.size() - _readOffset));
+				_buffer.insert(_buffer.end(), data, data + n);
+				data += n;
+				size -= n;
+				_cond.notify_all();
+			}
+		}
+
+		void Close()
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_closed = true;
+			_cond.notify_all();
+		}
+
+		void Fail()
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_failed = true;
+			_cond.notify_all();
+		}
+	};
+	DECLARE_PTR(UploadStream);
+
+	class StreamingUpload //! SendObject running in background thread, fed by writes at increasing offsets
+	{
+		UploadStreamPtr		_stream;
+		std::thread			_thread;
+		off_t				_offset;
+		std::string			_error;
+
+	public:
+		StreamingUpload(const mtp::SessionPtr &session): _stream(std::make_shared<UploadStream>()), _offset(0)
+		{
+			_thread = std::thread([this, session]()
 			{
-				FUSE_CALL(fuse_reply_buf(req, data.data() + off, std::min<size_t>(size, data.size() - off)));
+				try { session->SendObject(_stream); }
+				catch(const std::exception &ex) { _error = ex.what(); _stream->Fail(); }
+			});
+		}
+
+		~StreamingUpload()
+		{
+			if (_thread.joinable())
+			{
+				_stream->Cancel();
+				_thread.join();
+			}
+		}
+
+		off_t GetOffset() const
+		{ return _offset; }
+
+		void Write(const char *data, size_t size)
+		{
+			_stream->Write(data, size);
+			_offset += size;
+		}
+
+		///ends data phase, returns object size
+		off_t Finish()
+		{
+			_stream->Close();
+			_thread.join();
+			if (!_error.empty())
+				throw std::runtime_error("SendObject failed: " + _error);
+			return _offset;
+		}
+	};
+	DECLARE_PTR(StreamingUpload);
+
+	class MtimeOverlay //! host-side modification times for devices refusing to set DateModified, persisted per device by persistent unique object id
+	{
+		struct Entry
+		{
+			time_t	DeviceMtime; //overlay is valid while object keeps its device mtime and size
+			off_t	Size;
+			time_t	Mtime;
+		};
+
+		std::map<mtp::ByteArray, Entry>				_entries;
+		std::multiset<std::pair<time_t, off_t>>		_candidates; //device mtime and size of entries, matching objects need their persistent id
+		std::map<mtp::ObjectId, mtp::ByteArray>		_persistentIds; //handles are valid for current session only
+		std::string									_path;
+
+		static std::string ToHex(const mtp::ByteArray &data)
+		{
+			std::string text;
+			char buf[3];
+			for(mtp::u8 byte : data)
+			{
+				snprintf(buf, sizeof(buf), "%02x", byte);
+				text += buf;
+			}
+			return text;
+		}
+
+		static bool FromHex(const std::string &text, mtp::ByteArray &data)
+		{
+			if (text.empty() || text.size() % 2)
+				return false;
+			data.clear();
+			for(size_t i = 0; i < text.size(); i += 2)
+			{
+				if (!isxdigit(static_cast<unsigned char>(text[i])) || !isxdigit(static_cast<unsigned char>(text[i + 1])))
+					return false;
+				data.push_back(static_cast<mtp::u8>(strtoul(text.substr(i, 2).c_str(), NULL, 16)));
+			}
+			return true;
+		}
+
+		void Insert(const mtp::ByteArray &persistentId, time_t deviceMtime, off_t size, time_t mtime)
+		{
+			Erase(persistentId);
+			Entry &e = _entries[persistentId];
+			e.DeviceMtime = deviceMtime;
+			e.Size = size;
+			e.Mtime = mtime;
+			_candidates.insert(std::make_pair(deviceMtime, size));
+		}
+
+		bool Erase(const mtp::ByteArray &persistentId)
+		{
+			auto i = _entries.find(persistentId);
+			if (i == _entries.end())
+				return false;
+			_candidates.erase(_candidates.find(std::make_pair(i->second.DeviceMtime, i->second.Size)));
+			_entries.erase(i);
+			return true;
+		}
+
+		void Append(const std::string &line)
+		{
+			if (_path.empty())
+				return;
+			FILE *f = fopen(_path.c_str(), "a");
+			if (!f)
+			{
+				mtp::error("cannot write mtime overlay ", _path, ": ", strerror(errno));
+				return;
+			}
+			fputs(line.c_str(), f);
+			fclose(f);
+		}
+
+	public:
+		///loads overlay log from cache directory and compacts it
+		void Load(const std::string &serial)
+		{
+			_entries.clear();
+			_candidates.clear();
+			_persistentIds.clear();
+			_path.clear();
+
+			_path = fs::GetCachePath(serial, ".mtime");
+			if (_path.empty())
+				return;
+
+			{
+				std::ifstream file(_path.c_str());
+				std::string id;
+				long long deviceMtime, size, mtime;
+				while(file >> id >> deviceMtime >> size >> mtime)
+				{
+					mtp::ByteArray persistentId;
+					if (!FromHex(id, persistentId))
+						continue;
+					if (mtime < 0)
+						Erase(persistentId);
+					else
+						Insert(persistentId, deviceMtime, size, mtime);
+				}
 			}
+
+			std::string tmp = _path + ".tmp";
+			{
+				std::ofstream file(tmp.c_str(), std::ios::out | std::ios::trunc);
+				for(auto &i : _entries)
+					file << ToHex(i.first) << " " << (long long)i.second.DeviceMtime << " " << (long long)i.second.Size << " " << (long long)i.second.Mtime << "\n";
+			}
+			rename(tmp.c_str(), _path.c_str());
+		}
+
+		///returns true if attributes match some entry and persistent id of the object is not known yet
+		bool NeedsPersistentId(mtp::ObjectId id, const struct stat &attr) const
+		{ return _candidates.count(std::make_pair(attr.st_mtime, attr.st_size)) && _persistentIds.find(id) == _persistentIds.end(); }
+
+		///remembers persistent id of the object for this session, empty if device could not report it
+		void SetPersistentId(mtp::ObjectId id, const mtp::ByteArray &persistentId)
+		{ _persistentIds[id] = persistentId; }
+
+		void Set(mtp::ObjectId id, const mtp::ByteArray &persistentId, time_t deviceMtime, off_t size, time_t mtime)
+		{
+			_persistentIds[id] = persistentId;
+			Insert(persistentId, deviceMtime, size, mtime);
+			std::ostringstream line;
+			line << ToHex(persistentId) << " " << (long long)deviceMtime << " " << (long long)size << " " << (long long)mtime << "\n";
+			Append(line.str());
 		}
+
+		void Remove(mtp::ObjectId id)
+		{
+			auto i = _persistentIds.find(id);
+			if (i == _persistentIds.end())
+				return;
+			if (Erase(i->second))
+				Append(ToHex(i->second) + " 0 0 -1\n");
+			_persistentIds.erase(i);
+		}
+
+		///replaces device mtime in freshly queried attributes, persistent id has to be resolved first, see \ref NeedsPersistentId
+		void Apply(mtp::ObjectId id, struct stat &attr) const
+		{
+			auto pi = _persistentIds.find(id);
+			if (pi == _persistentIds.end())
+				return;
+			auto i = _entries.find(pi->second);
+			if (i != _entries.end() && i->second.DeviceMtime == attr.st_mtime && i->second.Size == attr.st_size)
+				attr.st_mtime = i->second.Mtime;
+		}
+	};
+
+	enum ControlFileIndex
+	{
+		ControlDirectory, ControlStats, ControlDropCaches, ControlPrefetch, ControlReadAhead, ControlFileCount
+	};
+
+	struct ControlFile //! entry of hidden /.aft directory exposing statistics and runtime controls
+	{
+		const char *	Name;
+		mode_t			Mode;
+	};
+
+	const ControlFile ControlFiles[ControlFileCount] =
+	{
+		{ ".aft",			S_IFDIR | 0555 },
+		{ "stats",			S_IFREG | 0444 }, //per-operation counters, cache and transfer statistics
+		{ "drop_caches",	S_IFREG | 0200 }, //any write drops cached listings and attributes
+		{ "prefetch",		S_IFREG | 0200 }, //path relative to mount root, crawled in background
+		{ "read_ahead",		S_IFREG | 0644 }, //maximum read-ahead in KiB
+	};
+
+	const char * const ThumbnailAttribute = "user.mtp.thumbnail";
+
+	struct MountOptions //! aft_* options parsed from -o, removed before passing arguments to fuse
+	{
+		int			PersistentCache;
+		int			Prefetch;
+		unsigned	CacheMemory; //MiB, 0 - unlimited
+		int			KeepCache;
+		int			AllDevices; //mount every device in subdirectory named after its serial
+
+		MountOptions(): PersistentCache(0), Prefetch(0), CacheMemory(256), KeepCache(0), AllDevices(0) { }
 	};
 
 	class FuseWrapper
 	{
+		//_mutex serialises device access and cache updates, _cacheMutex guards cache against lock-free readers
+		//cache is modified only with both locks held, so _mutex holders may read it without _cacheMutex
 		std::mutex		_mutex;
+		SharedMutex		_cacheMutex;
 		mtp::DevicePtr	_device;
 		mtp::SessionPtr	_session;
 		bool			_editObjectSupported;
 		bool			_getObjectPropertyListSupported;
+		bool			_dateModifiedWritable;
+		MtimeOverlay	_mtimeOverlay;
+		fs::ThumbnailCache	_thumbnails;
+		std::map<mtp::ObjectId, mtp::ByteArray>	_thumbnailIds; //persistent unique ids of objects thumbnails were asked for this session
 		time_t			_connectTime;
+		MountOptions	_options;
+		std::string		_serial; //device to reconnect to, any device if empty
+
+		struct StorageSpace //! storage info for statfs, adjusted locally between refreshes
+		{
+			std::chrono::steady_clock::time_point	Updated;
+			mtp::u64								Free;
+			mtp::u64								Capacity;
+		};
+		std::map<mtp::StorageId, StorageSpace>	_storageSpace;
+
+		static const unsigned					StorageSpaceTimeout = 10; //seconds
+
+		typedef fs::PersistentCache::Key PersistentKey;
+		fs::PersistentCache						_persistentCache;
+		std::map<mtp::ObjectId, PersistentKey>	_persistentKeys; //storage and persistent unique id of listed directories
+
+		unsigned					_connectGeneration;
+		std::thread					_prefetchThread;
+		std::mutex					_prefetchMutex;
+		std::condition_variable		_prefetchCondition;
+		bool						_prefetchStop;
 
-		typedef std::map<std::string, FuseId> ChildrenObjects;
-		typedef std::map<FuseId, ChildrenObjects> Files;
-		Files			_files;
+		NotifyChannel *				_notifyChannel;
+		std::thread					_invalidateThread;
+		std::mutex					_invalidateMutex;
+		std::condition_variable		_invalidateCondition;
+		std::deque<FuseId>			_invalidateQueue;
+		bool						_invalidateStop;
 
+		std::mutex					_readMutex;
+		ReadRequests				_readQueue;
+		bool						_readServing; //some thread is draining _readQueue
+
+		static const size_t			MaxMergedRead = 8 * 1024 * 1024;
+
+		typedef std::map<std::string, FuseId> ChildrenObjects; //children collected while enumerating directory
 		typedef std::map<mtp::ObjectId, struct stat> ObjectAttrs;
-		ObjectAttrs		_objectAttrs;
+
+		struct FuseIdHash
+		{
+			size_t operator()(FuseId id) const
+			{ return std::hash<fuse_ino_t>()(id.Inode); }
+		};
+		typedef std::unordered_map<FuseId, fs::DirectoryEntries, FuseIdHash> Files;
+		Files				_files;
+		fs::AttributeTable	_objectAttrs;
 
 		typedef mtp::Session::ObjectEditSessionPtr ObjectEditSessionPtr;
 		typedef std::map<FuseId, ObjectEditSessionPtr> OpenedFiles;
 		OpenedFiles		_openedFiles;
 
-		typedef std::map<FuseId, CharArray> DirectoryCache;
-		DirectoryCache	_directoryCache;
+		fs::LocationTable	_objectLocations; //parents of all enumerated objects, kept when listings are evicted
+
+		struct PageCacheState //! attributes of file when kernel page cache was filled, see MountOptions::KeepCache
+		{
+			mtp::u64	Size;
+			mtp::s64	Mtime;
+		};
+		typedef std::unordered_map<FuseId, PageCacheState, FuseIdHash> PageCache;
+		PageCache			_pageCache;
+
+		struct DirectoryUsage //! recency and estimated memory of cached directory, LastUse is updated by lock-free readers
+		{
+			std::atomic<uint64_t>	LastUse;
+			size_t					Memory;
+
+			DirectoryUsage(): LastUse(0), Memory(0) { }
+		};
+		std::map<FuseId, DirectoryUsage>	_directoryUsage;
+		std::atomic<uint64_t>				_useClock;
+		size_t								_cacheMemory;
+		std::atomic<uint64_t>				_cacheHits, _cacheMisses, _cacheEvictions;
+
+		static const size_t					MapNodeOverhead = 48; //hash node and allocator overhead
+
+		typedef std::map<FuseId, WriteBuffer> WriteBuffers;
+		WriteBuffers	_writeBuffers;
+		size_t			_writeBuffersSize;
+
+		static const size_t					WriteBackThreshold = 16 * 1024 * 1024; //per file
+		static const size_t					WriteBackMemoryLimit = 64 * 1024 * 1024; //all files
+
+		typedef std::map<FuseId, StreamingUploadPtr> Uploads;
+		Uploads			_uploads;
+
+		typedef std::map<uint64_t, FileHandle> FileHandles;
+		FileHandles		_fileHandles;
+		uint64_t		_nextFileHandle;
+		bool			_spliceRead;
 
 		static const size_t					MtpStorageShift = FUSE_ROOT_ID + 1;
 		static const size_t					MtpObjectShift = 999998 + MtpStorageShift;
+		static const size_t					ControlShift = MtpObjectShift - ControlFileCount; //below object inodes, storages never get that far
+
+		static const size_t					MaxReadAheadLimit = 64 * 1024 * 1024;
+		size_t								_maxReadAhead;
+		fs::Statistics						_statistics;
+		std::deque<FuseId>					_prefetchRequests; //subtrees requested through /.aft/prefetch, guarded by _prefetchMutex
 
 		std::vector<mtp::StorageId>					_storageIdList;
 		std::map<mtp::StorageId, std::string>		_storageToName;
@@ -191,7 +894,13 @@ namespace
 		{ return mtp::ObjectId(id.Inode - MtpObjectShift); }
 
 		static bool IsStorage(FuseId id)
-		{ return id.Inode >= MtpStorageShift && id.Inode <= MtpObjectShift; }
+		{ return id.Inode >= MtpStorageShift && id.Inode < ControlShift; }
+
+		static bool IsControl(FuseId id)
+		{ return id.Inode >= ControlShift && id.Inode < ControlShift + ControlFileCount; }
+
+		static FuseId ToControl(ControlFileIndex index)
+		{ return FuseId(ControlShift + index); }
 
 		mtp::StorageId FuseIdToStorageId(FuseId id) const
 		{
@@ -211,14 +920,14 @@ namespace
 			return FuseId(MtpStorageShift + std::distance(_storageIdList.begin(), i));
 		}
 
-		void GetObjectInfo(ChildrenObjects &cache, mtp::ObjectId id)
+		void GetObjectInfo(ChildrenObjects &cache, ObjectAttrs &attrs, mtp::ObjectId id)
 		{
 			mtp::msg::ObjectInfo oi = _session->GetObjectInfo(id);
 
 			FuseId inode = ToFuse(id);
 			cache.emplace(oi.Filename, inode);
 
-			struct stat &attr = _objectAttrs[id];
+			struct stat &attr = attrs[id];
 			attr.st_ino = inode.Inode;
 			attr.st_mode = FuseEntry::GetMode(oi.ObjectFormat);
 			attr.st_atime = attr.st_mtime = mtp::ConvertDateTime(oi.ModificationDate);
@@ -226,18 +935,305 @@ namespace
 			attr.st_size = oi.ObjectCompressedSize != mtp::MaxObjectSize? oi.ObjectCompressedSize: _session->GetObjectIntegerProperty(id, mtp::ObjectProperty::ObjectSize);
 		}
 
-		struct stat GetObjectAttr(FuseId inode)
+		///queries persistent id of an object host-side mtime may apply to, caller must hold _mutex
+		void ResolveMtimeOverlay(mtp::ObjectId id, const struct stat &attr)
 		{
-			if (inode == FuseId::Root)
+			if (!_mtimeOverlay.NeedsPersistentId(id, attr))
+				return;
+			mtp::ByteArray persistentId;
+			try
+			{ persistentId = _session->GetObjectProperty(id, mtp::ObjectProperty::PersistentUniqueObjectId); }
+			catch(const std::exception &ex)
+			{ mtp::debug("no persistent id for ", id, ": ", ex.what()); }
+			_mtimeOverlay.SetPersistentId(id, persistentId);
+		}
+
+		///publishes children and their attributes, replacing cached entries
+		void UpdateCache(FuseId parent, const ChildrenObjects &children, const ObjectAttrs &attrs)
+		{
+			for(auto &i : attrs)
+				ResolveMtimeOverlay(i.first, i.second);
+
+			ExclusiveLock l(_cacheMutex);
+			fs::DirectoryEntries &cache = _files[parent];
+			if (cache.Empty())
 			{
-				struct stat attr = { };
-				attr.st_ino = inode.Inode;
-				attr.st_mtime = attr.st_ctime = attr.st_atime = _connectTime;
-				attr.st_mode = FuseEntry::DirectoryMode;
-				return attr;
+				size_t namesSize = 0;
+				for(auto &i : children)
+					namesSize += i.first.size();
+				cache.Reserve(children.size(), namesSize);
 			}
-
-			if (IsStorage(inode))
+			for(auto &i : children)
+				cache.Set(i.first, i.second.Inode); //sorted input appends to empty directory
+			for(auto &i : attrs)
+			{
+				struct stat attr = i.second;
+				_mtimeOverlay.Apply(i.first, attr);
+				SetCachedObjectAttr(i.first, attr);
+				SetCachedLocation(i.first, parent);
+			}
+			UpdateUsage(parent);
+		}
+
+		///stores attributes in compact cache record, caller must hold exclusive lock
+		void SetCachedObjectAttr(mtp::ObjectId id, const struct stat &attr)
+		{
+			CheckPageCache(id, attr);
+			fs::ObjectAttributes &attrs = _objectAttrs.Get(id.Id);
+			attrs.Mode = attr.st_mode;
+			attrs.Size = attr.st_size;
+			attrs.Mtime = attr.st_mtime;
+			attrs.Ctime = attr.st_ctime;
+		}
+
+		///records parent of object, caller must hold exclusive lock
+		void SetCachedLocation(mtp::ObjectId id, FuseId parent)
+		{
+			if (parent == FuseId::Root)
+				return;
+			fs::ObjectLocation &location = _objectLocations.Get(id.Id);
+			if (IsStorage(parent))
+			{
+				location.Parent = mtp::Session::Root.Id;
+				location.Storage = parent.Inode;
+			}
+			else
+			{
+				location.Parent = FromFuse(parent).Id;
+				location.Storage = 0;
+			}
+		}
+
+		///finds parent of object without device access, caller must hold either lock
+		bool GetCachedParent(mtp::ObjectId id, FuseId &parent) const
+		{
+			const fs::ObjectLocation *location = _objectLocations.Find(id.Id);
+			if (!location)
+				return false;
+			parent = location->Parent == mtp::Session::Root.Id? FuseId(location->Storage): ToFuse(mtp::ObjectId(location->Parent));
+			return true;
+		}
+
+		///applies local change of used space to cached storage info, caller must hold _mutex
+		void AdjustFreeSpace(mtp::ObjectId id, mtp::s64 delta)
+		{
+			FuseId storage(FuseId::Root);
+			if (delta == 0 || !GetCachedStorage(id, storage) || !IsStorage(storage))
+				return;
+			auto i = _storageSpace.find(FuseIdToStorageId(storage));
+			if (i == _storageSpace.end())
+				return;
+			StorageSpace &space = i->second;
+			if (delta < 0 && mtp::u64(-delta) > space.Free)
+				space.Free = 0;
+			else
+				space.Free = std::min(space.Free + delta, space.Capacity);
+		}
+
+		///drops cached storage info of object, so next statfs asks device
+		void InvalidateStorageSpace(mtp::ObjectId id)
+		{
+			FuseId storage(FuseId::Root);
+			if (GetCachedStorage(id, storage) && IsStorage(storage))
+				_storageSpace.erase(FuseIdToStorageId(storage));
+			else
+				_storageSpace.clear();
+		}
+
+		const StorageSpace & GetStorageSpace(mtp::StorageId storageId)
+		{
+			auto now = std::chrono::steady_clock::now();
+			auto i = _storageSpace.find(storageId);
+			if (i != _storageSpace.end() && (now - i->second.Updated < std::chrono::seconds(int(StorageSpaceTimeout)) || !_uploads.empty()))
+				return i->second; //stale value is better than interrupting upload
+
+			FinishUploads();
+			mtp::msg::StorageInfo si = _session->GetStorageInfo(storageId);
+			StorageSpace &space = _storageSpace[storageId];
+			space.Updated = now;
+			space.Free = si.FreeSpaceInBytes;
+			space.Capacity = si.MaxCapacity;
+			return space;
+		}
+
+		///finds storage of object walking up cached parents, caller must hold either lock
+		bool GetCachedStorage(mtp::ObjectId id, FuseId &storage) const
+		{
+			for(size_t depth = 0; depth < _objectLocations.Size(); ++depth) //bounded in case of inconsistent moves
+			{
+				const fs::ObjectLocation *location = _objectLocations.Find(id.Id);
+				if (!location)
+					return false;
+				if (location->Parent == mtp::Session::Root.Id)
+				{
+					storage = FuseId(location->Storage);
+					return true;
+				}
+				id = mtp::ObjectId(location->Parent);
+			}
+			return false;
+		}
+
+		///updates size of cached object, if any. caller must hold exclusive lock
+		void SetCachedObjectSize(mtp::ObjectId id, off_t size)
+		{
+			fs::ObjectAttributes *attrs = _objectAttrs.Find(id.Id);
+			if (attrs)
+			{
+				AdjustFreeSpace(id, mtp::s64(attrs->Size) - size);
+				attrs->Size = size;
+			}
+			auto pages = _pageCache.find(ToFuse(id));
+			if (pages != _pageCache.end())
+				pages->second.Size = size; //written through kernel, page cache is up to date
+		}
+
+		static void ToStat(const fs::ObjectAttributes &attrs, struct stat &attr)
+		{
+			struct stat empty = { };
+			attr = empty;
+			attr.st_ino = ToFuse(mtp::ObjectId(attrs.Id)).Inode;
+			attr.st_mode = attrs.Mode;
+			attr.st_size = attrs.Size;
+			attr.st_atime = attr.st_mtime = attrs.Mtime;
+			attr.st_ctime = attrs.Ctime;
+		}
+
+		size_t EstimateMemory(FuseId inode) const
+		{
+			size_t size = 0;
+			auto files = _files.find(inode);
+			if (files != _files.end()) //attribute table slots are kept at most 70% full
+				size += MapNodeOverhead + files->second.GetMemoryUsage() + files->second.Size() * sizeof(fs::ObjectAttributes) * 10 / 7;
+			return size;
+		}
+
+		///updates memory estimate and marks directory as recently used, caller must hold exclusive lock
+		void UpdateUsage(FuseId inode)
+		{
+			if (inode == FuseId::Root)
+				return;
+			DirectoryUsage &usage = _directoryUsage[inode];
+			size_t memory = EstimateMemory(inode);
+			_cacheMemory += memory;
+			_cacheMemory -= usage.Memory;
+			usage.Memory = memory;
+			usage.LastUse = ++_useClock;
+		}
+
+		///marks directory as recently used, caller must hold either lock
+		void Touch(FuseId inode)
+		{
+			auto i = _directoryUsage.find(inode);
+			if (i != _directoryUsage.end())
+				i->second.LastUse = ++_useClock;
+		}
+
+		size_t GetCacheMemoryLimit() const
+		{ return size_t(_options.CacheMemory) * 1024 * 1024; }
+
+		///evicts least recently used directories until cache fits in 3/4 of memory budget
+		///directories containing open, uploading or dirty files or cached subdirectories are kept. must not be called while references to cache are held
+		void EnforceCacheLimit()
+		{
+			size_t limit = GetCacheMemoryLimit();
+			if (limit == 0 || _cacheMemory <= limit)
+				return;
+
+			ExclusiveLock l(_cacheMutex);
+			_cacheMemory = 0; //estimates drift with in-place updates, recount
+			for(auto &i : _directoryUsage)
+				_cacheMemory += (i.second.Memory = EstimateMemory(i.first));
+			if (_cacheMemory <= limit)
+				return;
+
+			std::set<FuseId> pinned;
+			for(auto &i : _fileHandles)
+				pinned.insert(i.second.Inode);
+			for(auto &i : _uploads)
+				pinned.insert(i.first);
+			for(auto &i : _writeBuffers)
+				pinned.insert(i.first);
+			for(auto &i : _openedFiles)
+				pinned.insert(i.first);
+
+			std::vector<std::pair<uint64_t, FuseId>> lru;
+			lru.reserve(_directoryUsage.size());
+			for(auto &i : _directoryUsage)
+				lru.push_back(std::make_pair(i.second.LastUse.load(), i.first));
+			std::sort(lru.begin(), lru.end());
+
+			//only leaf directories are evicted, listing of subdirectory would be unreachable once its attributes are gone
+			//every pass turns parents of evicted directories into leaves
+			size_t target = limit / 4 * 3, evicted = 0;
+			for(bool progress = true; progress && _cacheMemory > target; )
+			{
+				progress = false;
+				for(auto &i : lru)
+				{
+					if (_cacheMemory <= target)
+						break;
+					FuseId inode = i.second;
+					auto usage = _directoryUsage.find(inode);
+					if (usage == _directoryUsage.end())
+						continue;
+					auto files = _files.find(inode);
+					if (files != _files.end())
+					{
+						const fs::DirectoryEntries &entries = files->second;
+						bool busy = false;
+						for(size_t c = 0; c < entries.Size() && !busy; ++c)
+						{
+							FuseId child(entries.GetInode(c));
+							busy = pinned.count(child) != 0 || _files.count(child) != 0;
+						}
+						if (busy)
+							continue;
+						for(size_t c = 0; c < entries.Size(); ++c)
+							_objectAttrs.Erase(FromFuse(FuseId(entries.GetInode(c))).Id);
+						_files.erase(files);
+					}
+					_cacheMemory -= usage->second.Memory;
+					_directoryUsage.erase(usage);
+					++evicted;
+					progress = true;
+				}
+			}
+			_cacheEvictions += evicted;
+			mtp::debug("evicted ", evicted, " directories, cache uses ", _cacheMemory / 1024, " KiB, hits: ", _cacheHits.load(), ", misses: ", _cacheMisses.load(), ", evictions: ", _cacheEvictions.load());
+		}
+
+		///returns attributes without device access, caller must hold either lock
+		bool GetCachedObjectAttr(FuseId inode, struct stat &attr) const
+		{
+			if (inode == FuseId::Root || IsStorage(inode))
+			{
+				struct stat empty = { };
+				attr = empty;
+				attr.st_ino = inode.Inode;
+				attr.st_mtime = attr.st_ctime = attr.st_atime = _connectTime;
+				attr.st_mode = FuseEntry::DirectoryMode;
+				return true;
+			}
+			if (IsControl(inode))
+			{
+				struct stat empty = { };
+				attr = empty;
+				attr.st_ino = inode.Inode;
+				attr.st_mtime = attr.st_ctime = attr.st_atime = _connectTime;
+				attr.st_mode = ControlFiles[inode.Inode - ControlShift].Mode;
+				return true;
+			}
+			const fs::ObjectAttributes *attrs = _objectAttrs.Find(FromFuse(inode).Id);
+			if (!attrs)
+				return false;
+			ToStat(*attrs, attr);
+			return true;
+		}
+
+		struct stat GetObjectAttr(FuseId inode)
+		{
+			if (inode == FuseId::Root)
 			{
 				struct stat attr = { };
 				attr.st_ino = inode.Inode;
@@ -246,22 +1242,37 @@ namespace
 				return attr;
 			}
 
-			mtp::ObjectId id = FromFuse(inode);
-			auto i = _objectAttrs.find(id);
-			if (i != _objectAttrs.end())
-				return i->second;
+			if (IsStorage(inode))
+			{
+				struct stat attr = { };
+				attr.st_ino = inode.Inode;
+				attr.st_mtime = attr.st_ctime = attr.st_atime = _connectTime;
+				attr.st_mode = FuseEntry::DirectoryMode;
+				return attr;
+			}
+
+			struct stat attr;
+			if (GetCachedObjectAttr(inode, attr))
+				return attr;
 
 			//populate cache for parent
+			FinishUploads();
 			auto parent = GetParentObject(inode);
 			GetChildren(parent); //populate cache
 
-			i = _objectAttrs.find(id);
-			if (i != _objectAttrs.end())
-				return i->second;
+			if (GetCachedObjectAttr(inode, attr))
+				return attr;
 			else
 				throw std::runtime_error("no such object");
 		}
 
+		template<typename PropertyValueType>
+		static void ReadPropertyValue(mtp::InputStream &stream, PropertyValueType &value)
+		{ stream >> value; }
+
+		static void ReadPropertyValue(mtp::InputStream &stream, mtp::ByteArray &value) //u128 values have no array length prefix
+		{ value = stream.GetData(); }
+
 		template<typename PropertyValueType>
 		void GetObjectPropertyList(mtp::ObjectId parent, const std::set<mtp::ObjectId> &originalObjectList, const mtp::ObjectProperty property,
 			const std::function<void (mtp::ObjectId, const PropertyValueType &)> &callback)
@@ -292,7 +1303,7 @@ namespace
 						mtp::ByteArray data = _session->GetObjectProperty(objectId, property);
 						mtp::InputStream stream(data);
 						PropertyValueType value = PropertyValueType();
-						stream >> value;
+						ReadPropertyValue(stream, value);
 						callback(objectId, value);
 					}
 					catch(const std::exception &ex) { mtp::error("fallback query/callback for property 0x", mtp::hex(property, 4), " failed: ", ex.what()); }
@@ -300,50 +1311,52 @@ namespace
 			}
 		}
 
-		ChildrenObjects & GetChildren(FuseId inode)
+		fs::DirectoryEntries & GetChildren(FuseId inode)
 		{
 			if (inode == FuseId::Root)
 			{
+				auto i = _files.find(inode);
+				if (i != _files.end() && !_uploads.empty())
+					return i->second;
+				FinishUploads();
 				PopulateStorages();
-				ChildrenObjects & cache = _files[inode];
-				cache.clear();
+				fs::DirectoryEntries storages;
 				for(size_t i = 0; i < _storageIdList.size(); ++i)
 				{
 					mtp::StorageId storageId = _storageIdList[i];
 					auto name = _storageToName.find(storageId);
 					if (name != _storageToName.end())
-						cache.emplace(name->second, FuseId(MtpStorageShift + i));
+						storages.Insert(name->second, MtpStorageShift + i);
 					else
 						mtp::error("no storage name for ", storageId);
 				}
+				ExclusiveLock l(_cacheMutex);
+				fs::DirectoryEntries & cache = _files[inode];
+				std::swap(cache, storages);
 				return cache;
 			}
 
 			{
 				auto i = _files.find(inode);
 				if (i != _files.end())
+				{
+					++_cacheHits;
+					Touch(inode);
 					return i->second;
+				}
 			}
 
-			ChildrenObjects & cache = _files[inode];
+			++_cacheMisses;
+			FinishUploads();
+			ChildrenObjects cache;
+			ObjectAttrs attrs;
 
 			using namespace mtp;
-			if (inode == FuseId::Root)
-			{
-				return cache;
-			}
-
-			msg::ObjectHandles oh;
+			msg::ObjectHandles oh = GetObjectHandles(inode);
 
-			if (IsStorage(inode))
-			{
-				mtp::StorageId storageId = FuseIdToStorageId(inode);
-				oh = _session->GetObjectHandles(storageId, mtp::ObjectFormat::Any, mtp::Session::Root);
-			}
-			else
+			if (!IsStorage(inode))
 			{
 				mtp::ObjectId parent = FromFuse(inode);
-				oh = _session->GetObjectHandles(mtp::Session::AllStorages, mtp::ObjectFormat::Any, parent);
 
 				if (_getObjectPropertyListSupported)
 				{
@@ -351,6 +1364,23 @@ namespace
 					for(auto id : oh.ObjectHandles)
 						objects.insert(id);
 
+					auto key = _persistentCache.IsOpen()? _persistentKeys.find(parent): _persistentKeys.end();
+					if (key != _persistentKeys.end())
+					{
+						try
+						{
+							if (RestoreChildren(key->second, parent, objects, cache, attrs))
+							{
+								UpdateCache(inode, cache, attrs);
+								return _files.at(inode);
+							}
+						}
+						catch(const std::exception &ex)
+						{ mtp::debug("restoring from persistent cache failed: ", ex.what()); }
+						cache.clear();
+						attrs.clear();
+					}
+
 					//populate filenames
 					GetObjectPropertyList<std::string>(parent, objects, mtp::ObjectProperty::ObjectFilename,
 						[&cache](ObjectId objectId, const std::string &name)
@@ -358,24 +1388,24 @@ namespace
 
 					//format
 					GetObjectPropertyList<mtp::ObjectFormat>(parent, objects, mtp::ObjectProperty::ObjectFormat,
-						[this](ObjectId objectId, mtp::ObjectFormat format)
+						[&attrs](ObjectId objectId, mtp::ObjectFormat format)
 						{
-							struct stat & attr = _objectAttrs[objectId];
+							struct stat & attr = attrs[objectId];
 							attr.st_ino = ToFuse(objectId).Inode;
 							attr.st_mode = FuseEntry::GetMode(format);
 						});
 
 					//size
 					GetObjectPropertyList<mtp::u64>(parent, objects, mtp::ObjectProperty::ObjectSize,
-						[this](ObjectId objectId, mtp::u64 size)
-						{ _objectAttrs[objectId].st_size = size; });
+						[&attrs](ObjectId objectId, mtp::u64 size)
+						{ attrs[objectId].st_size = size; });
 
 					//mtime
 					try
 					{
 						GetObjectPropertyList<std::string>(parent, objects, mtp::ObjectProperty::DateModified,
-						[this](ObjectId objectId, const std::string & mtime)
-						{ _objectAttrs[objectId].st_mtime = mtp::ConvertDateTime(mtime); });
+						[&attrs](ObjectId objectId, const std::string & mtime)
+						{ attrs[objectId].st_mtime = mtp::ConvertDateTime(mtime); });
 					}
 					catch(const std::exception &ex)
 					{ }
@@ -384,15 +1414,22 @@ namespace
 					try
 					{
 						GetObjectPropertyList<std::string>(parent, objects, mtp::ObjectProperty::DateAdded,
-						[this](ObjectId objectId, const std::string & ctime)
-						{ _objectAttrs[objectId].st_ctime = mtp::ConvertDateTime(ctime); });
+						[&attrs](ObjectId objectId, const std::string & ctime)
+						{ attrs[objectId].st_ctime = mtp::ConvertDateTime(ctime); });
 					}
 					catch(const std::exception &ex)
 					{ }
 
+					if (key != _persistentKeys.end())
+					{
+						try
+						{ StoreChildren(key->second, parent, objects, cache, attrs); }
+						catch(const std::exception &ex)
+						{ mtp::debug("storing persistent cache failed: ", ex.what()); }
+					}
 
-
-					return cache;
+					UpdateCache(inode, cache, attrs);
+					return _files.at(inode);
 				}
 			}
 
@@ -400,25 +1437,185 @@ namespace
 			{
 				try
 				{
-					GetObjectInfo(cache, id);
+					GetObjectInfo(cache, attrs, id);
 				} catch(const std::exception &ex)
 				{ }
 			}
-			return cache;
+			if (IsStorage(inode))
+				AddPersistentKeys(inode, attrs);
+			UpdateCache(inode, cache, attrs);
+			return _files.at(inode);
 		}
 
-		FuseId CreateObject(FuseId parentInode, const std::string &filename, mtp::ObjectFormat format)
+		mtp::msg::ObjectHandles GetObjectHandles(FuseId inode)
 		{
-			mtp::ObjectId parentId = FromFuse(parentInode);
-			mtp::StorageId storageId;
+			if (IsStorage(inode))
+				return _session->GetObjectHandles(FuseIdToStorageId(inode), mtp::ObjectFormat::Any, mtp::Session::Root);
+			else
+				return _session->GetObjectHandles(mtp::Session::AllStorages, mtp::ObjectFormat::Any, FromFuse(inode));
+		}
+
+		///records persistent keys of storage root directories, their listings are not cached, but their subdirectories are
+		void AddPersistentKeys(FuseId storage, const ObjectAttrs &attrs)
+		{
+			if (!_persistentCache.IsOpen())
+				return;
+			mtp::StorageId storageId = FuseIdToStorageId(storage);
+			for(auto &i : attrs)
+			{
+				if (!S_ISDIR(i.second.st_mode))
+					continue;
+				try
+				{ _persistentKeys.emplace(i.first, PersistentKey(storageId.Id, _session->GetObjectProperty(i.first, mtp::ObjectProperty::PersistentUniqueObjectId))); }
+				catch(const std::exception &ex)
+				{ mtp::debug("no persistent id for ", i.first, ": ", ex.what()); }
+			}
+		}
+
+		///restores listing from persistent cache if it has the same objects, refetching objects with changed mtime
+		bool RestoreChildren(const PersistentKey &key, mtp::ObjectId parent, const std::set<mtp::ObjectId> &objects, ChildrenObjects &cache, ObjectAttrs &attrs)
+		{
+			fs::PersistentCache::Entries entries;
+			if (!_persistentCache.Get(key, entries) || entries.size() != objects.size())
+				return false;
+
+			std::map<mtp::ByteArray, size_t> byId;
+			for(size_t i = 0; i < entries.size(); ++i)
+				byId[entries[i].PersistentId] = i;
+
+			std::map<mtp::ObjectId, size_t> found;
+			GetObjectPropertyList<mtp::ByteArray>(parent, objects, mtp::ObjectProperty::PersistentUniqueObjectId,
+				[&byId, &found](mtp::ObjectId objectId, const mtp::ByteArray &id)
+				{
+					auto i = byId.find(id);
+					if (i != byId.end())
+						found[objectId] = i->second;
+				});
+			if (found.size() != objects.size())
+				return false;
+
+			std::map<mtp::ObjectId, time_t> mtimes;
+			try
+			{
+				GetObjectPropertyList<std::string>(parent, objects, mtp::ObjectProperty::DateModified,
+				[&mtimes](mtp::ObjectId objectId, const std::string & mtime)
+				{ mtimes[objectId] = mtp::ConvertDateTime(mtime); });
+			}
+			catch(const std::exception &ex)
+			{ }
+
+			bool changed = false;
+			for(auto &i : found)
+			{
+				mtp::ObjectId id = i.first;
+				fs::PersistentCache::Entry &entry = entries[i.second];
+				auto mtime = mtimes.find(id);
+				if (mtime != mtimes.end() && mtime->second != entry.Mtime)
+				{
+					ChildrenObjects objectCache;
+					GetObjectInfo(objectCache, attrs, id);
+					if (objectCache.empty())
+						return false;
+					const struct stat &attr = attrs[id];
+					entry.Name = objectCache.begin()->first;
+					entry.Mode = attr.st_mode;
+					entry.Size = attr.st_size;
+					entry.Mtime = attr.st_mtime;
+					entry.Ctime = attr.st_ctime;
+					changed = true;
+				}
+
+				FuseId inode = ToFuse(id);
+				cache.emplace(entry.Name, inode);
+				struct stat &attr = attrs[id];
+				attr.st_ino = inode.Inode;
+				attr.st_mode = entry.Mode;
+				attr.st_size = entry.Size;
+				attr.st_atime = attr.st_mtime = entry.Mtime;
+				attr.st_ctime = entry.Ctime;
+				if (S_ISDIR(entry.Mode))
+				{
+					_persistentKeys.erase(id);
+					_persistentKeys.emplace(id, PersistentKey(key.StorageId, entry.PersistentId));
+				}
+			}
+			if (changed)
+				_persistentCache.Set(key, entries);
+			mtp::debug("restored ", entries.size(), " objects from persistent cache");
+			return true;
+		}
+
+		void StoreChildren(const PersistentKey &key, mtp::ObjectId parent, const std::set<mtp::ObjectId> &objects, const ChildrenObjects &cache, const ObjectAttrs &attrs)
+		{
+			std::map<mtp::ObjectId, mtp::ByteArray> ids;
+			GetObjectPropertyList<mtp::ByteArray>(parent, objects, mtp::ObjectProperty::PersistentUniqueObjectId,
+				[&ids](mtp::ObjectId objectId, const mtp::ByteArray &id)
+				{ ids[objectId] = id; });
+
+			fs::PersistentCache::Entries entries;
+			entries.reserve(cache.size());
+			for(auto &i : cache)
+			{
+				mtp::ObjectId id = FromFuse(i.second);
+				auto persistentId = ids.find(id);
+				auto attr = attrs.find(id);
+				if (persistentId == ids.end() || attr == attrs.end())
+				{
+					_persistentCache.Invalidate(key);
+					return;
+				}
+
+				fs::PersistentCache::Entry entry;
+				entry.Name = i.first;
+				entry.PersistentId = persistentId->second;
+				entry.Mode = attr->second.st_mode;
+				entry.Size = attr->second.st_size;
+				entry.Mtime = attr->second.st_mtime;
+				entry.Ctime = attr->second.st_ctime;
+				entries.push_back(entry);
+				if (S_ISDIR(entry.Mode))
+				{
+					_persistentKeys.erase(id);
+					_persistentKeys.emplace(id, PersistentKey(key.StorageId, entry.PersistentId));
+				}
+			}
+			_persistentCache.Set(key, entries);
+		}
+
+		void InvalidatePersistentCache(FuseId inode)
+		{
+			if (inode == FuseId::Root || IsStorage(inode))
+				return;
+			auto i = _persistentKeys.find(FromFuse(inode));
+			if (i != _persistentKeys.end())
+				_persistentCache.Invalidate(i->second);
+		}
+
+		void GetParentIds(FuseId parentInode, mtp::StorageId &storageId, mtp::ObjectId &parentId)
+		{
+			parentId = FromFuse(parentInode);
 			if (IsStorage(parentInode))
 			{
 				storageId = FuseIdToStorageId(parentInode);
 				parentId = mtp::Session::Root;
 			}
 			else
-				storageId = _session->GetObjectStorage(parentId);
-			mtp::debug("   creating object in storage ", mtp::hex(storageId.Id), ", parent: ", mtp::hex(parentId.Id, 8));
+			{
+				FuseId storage(FuseId::Root);
+				if (GetCachedStorage(parentId, storage) && IsStorage(storage))
+					storageId = FuseIdToStorageId(storage);
+				else
+					storageId = _session->GetObjectStorage(parentId);
+			}
+			mtp::debug("   storage ", mtp::hex(storageId.Id), ", parent: ", mtp::hex(parentId.Id, 8));
+		}
+
+		FuseId CreateObject(FuseId parentInode, const std::string &filename, mtp::ObjectFormat format)
+		{
+			FinishUploads();
+			mtp::ObjectId parentId;
+			mtp::StorageId storageId;
+			GetParentIds(parentInode, storageId, parentId);
 
 			mtp::Session::NewObjectInfo noi;
 			if (format != mtp::ObjectFormat::Association)
@@ -435,17 +1632,21 @@ namespace
 			mtp::debug("   new object id ", noi.ObjectId.Id);
 
 			{ //update cache:
-				auto i = _files.find(parentInode);
-				if (i != _files.end())
-					GetObjectInfo(i->second, noi.ObjectId); //insert object info into cache
-				_directoryCache.erase(parentInode);
+				ChildrenObjects children;
+				ObjectAttrs attrs;
+				if (_files.find(parentInode) != _files.end())
+				{
+					GetObjectInfo(children, attrs, noi.ObjectId);
+					UpdateCache(parentInode, children, attrs);
+				}
+				InvalidatePersistentCache(parentInode);
 			}
 			return ToFuse(noi.ObjectId);
 		}
 
 		void CreateObject(mtp::ObjectFormat format, fuse_req_t req, FuseId parentId, const char *name, mode_t mode)
 		{
-			if (parentId == FuseId::Root)
+			if (parentId == FuseId::Root || IsControl(parentId))
 			{
 				FUSE_CALL(fuse_reply_err(req, EPERM)); //cannot create files in the same level with storages
 				return;
@@ -466,6 +1667,11 @@ namespace
 				return FuseId::Root;
 
 			mtp::ObjectId id = FromFuse(inode);
+			FuseId cached(FuseId::Root);
+			if (GetCachedParent(id, cached))
+				return cached;
+
+			FinishUploads();
 			mtp::ObjectId parent = _session->GetObjectParent(id);
 			if (parent == mtp::Session::Device || parent == mtp::Session::Root) //parent == root -> storage
 			{
@@ -475,242 +1681,1486 @@ namespace
 				return ToFuse(parent);
 		}
 
-		bool FillEntry(FuseEntry &entry, FuseId id)
+		void FinishUpload(FuseId inode)
 		{
-			try { entry.attr = GetObjectAttr(id); } catch(const std::exception &ex) { return false; }
-			entry.SetId(id);
-			return true;
+			auto it = _uploads.find(inode);
+			if (it == _uploads.end())
+				return;
+
+			StreamingUploadPtr upload = it->second;
+			_uploads.erase(it);
+			off_t size = upload->Finish();
+			mtp::debug("finished streaming upload of ", size, " bytes");
+			ExclusiveLock l(_cacheMutex);
+			SetCachedObjectSize(FromFuse(inode), size);
 		}
 
-	public:
-		FuseWrapper()
-		{ Connect(); }
+		///device is busy with SendObject data phase while upload is active, device access not served from cache ends it first.
+		///writers continue through edit transactions, devices without edit extension fail their next write
+		void FinishUploads()
+		{
+			while(!_uploads.empty())
+			{
+				mtp::debug("device needed by other request, ending streaming upload");
+				FinishUpload(_uploads.begin()->first);
+			}
+		}
 
-		void Connect()
+		void FlushWrites(FuseId inode)
 		{
-			mtp::scoped_mutex_lock l(_mutex);
+			auto it = _writeBuffers.find(inode);
+			if (it == _writeBuffers.end())
+				return;
 
-			_openedFiles.clear();
-			_files.clear();
-			_objectAttrs.clear();
-			_directoryCache.clear();
-			_session.reset();
-			_device.reset();
-			_device = mtp::Device::Find();
-			if (!_device)
-				throw std::runtime_error("no MTP device found");
+			FinishUploads();
 
-			_session = _device->OpenSession(1);
-			_editObjectSupported = _session->EditObjectSupported();
-			if (!_editObjectSupported)
-				mtp::error("your device does not have android EditObject extension, mounting read-only\n");
-			_getObjectPropertyListSupported = _session->GetObjectPropertyListSupported();
-			if (!_getObjectPropertyListSupported)
-				mtp::error("your device does not have GetObjectPropertyList extension, expect slow enumeration of big directories\n");
+			WriteBuffer &buffer = it->second;
+			mtp::debug("flushing ", buffer.Size, " bytes in ", buffer.Data.size(), " extents");
+			ObjectEditSessionPtr tr = GetTransaction(inode);
+			if (buffer.FileSize > buffer.RemoteSize)
+			{
+				tr->Truncate(buffer.FileSize);
+				buffer.RemoteSize = buffer.FileSize;
+			}
+			while(!buffer.Data.empty())
+			{
+				auto extent = buffer.Data.begin();
+				tr->Send(extent->first, extent->second);
+				buffer.Size -= extent->second.size();
+				_writeBuffersSize -= extent->second.size();
+				buffer.Data.erase(extent);
+			}
+			_writeBuffers.erase(it);
+		}
 
-			_connectTime = time(NULL);
-			PopulateStorages();
+		void FlushAllWrites()
+		{
+			while(!_writeBuffers.empty())
+				FlushWrites(_writeBuffers.begin()->first);
 		}
 
-		void PopulateStorages()
+		void DiscardWrites(FuseId inode)
 		{
-			_storageIdList.clear();
-			_storageFromName.clear();
-			_storageToName.clear();
-			mtp::msg::StorageIDs ids = _session->GetStorageIDs();
-			_storageIdList.reserve(ids.StorageIDs.size());
-			for(size_t i = 0; i < ids.StorageIDs.size(); ++i)
+			auto it = _writeBuffers.find(inode);
+			if (it != _writeBuffers.end())
 			{
-				mtp::StorageId id = ids.StorageIDs[i];
-				mtp::msg::StorageInfo si = _session->GetStorageInfo(id);
-				std::string path = (!si.StorageDescription.empty()? si.StorageDescription:  si.VolumeLabel);
-				if (path.empty())
-				{
-					char buf[64];
-					snprintf(buf, sizeof(buf), "sdcard%u", (unsigned)i);
-					path = buf;
-				}
-				FuseId inode(MtpStorageShift + i);
-				_storageIdList.push_back(id);
-				_storageFromName[path] = id;
-				_storageToName[id] = path;
+				_writeBuffersSize -= it->second.Size;
+				_writeBuffers.erase(it);
 			}
 		}
 
-		void Init(void *, fuse_conn_info *conn)
+		void InvalidateReadBuffers(FuseId inode)
 		{
-			mtp::scoped_mutex_lock l(_mutex);
-			conn->want |= conn->capable & FUSE_CAP_BIG_WRITES; //big writes
-			static const size_t MaxWriteSize = 1024 * 1024;
-			if (conn->max_write < MaxWriteSize)
-				conn->max_write = MaxWriteSize;
+			for(auto &i : _fileHandles)
+				if (i.second.Inode == inode)
+					i.second.Invalidate();
+		}
+
+		///crawls storages breadth-first, taking device lock for one directory at a time and only when no request holds it
+		void Prefetch()
+		{
+			std::deque<FuseId> queue;
+			unsigned generation = 0;
+			bool started = false;
+			size_t directories = 0;
+			while(true)
+			{
+				{
+					std::unique_lock<std::mutex> l(_prefetchMutex);
+					if (_prefetchStop)
+						break;
+				}
+
+				std::unique_lock<std::mutex> l(_mutex, std::try_to_lock);
+				if (!l.owns_lock())
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(20));
+					continue;
+				}
+
+				if (!started || generation != _connectGeneration)
+				{
+					started = true;
+					generation = _connectGeneration;
+					directories = 0;
+					queue.clear();
+					if (_options.Prefetch)
+					{
+						queue.push_back(FuseId::Root);
+						mtp::debug("prefetch started");
+					}
+				}
+				{
+					std::unique_lock<std::mutex> pl(_prefetchMutex);
+					queue.insert(queue.end(), _prefetchRequests.begin(), _prefetchRequests.end());
+					_prefetchRequests.clear();
+				}
+
+				if (queue.empty())
+				{
+					l.unlock();
+					std::unique_lock<std::mutex> pl(_prefetchMutex); //idle until reconnect resets caches
+					_prefetchCondition.wait_for(pl, std::chrono::seconds(1), [this]() { return _prefetchStop || !_prefetchRequests.empty(); });
+					continue;
+				}
+
+				if (!_uploads.empty())
+				{
+					l.unlock();
+					std::unique_lock<std::mutex> pl(_prefetchMutex); //device is busy with streaming upload, retry later
+					_prefetchCondition.wait_for(pl, std::chrono::seconds(1), [this]() { return _prefetchStop; });
+					continue;
+				}
+
+				FuseId inode = queue.front();
+				queue.pop_front();
+				try
+				{
+					const fs::DirectoryEntries &children = GetChildren(inode);
+					for(size_t i = 0; i < children.Size(); ++i)
+					{
+						FuseId child(children.GetInode(i));
+						struct stat attr;
+						if (GetCachedObjectAttr(child, attr) && S_ISDIR(attr.st_mode))
+							queue.push_back(child);
+					}
+					size_t limit = GetCacheMemoryLimit();
+					if (limit && _cacheMemory > limit / 4 * 3)
+					{
+						mtp::debug("prefetch stopped at cache memory limit after ", directories, " directories");
+						queue.clear(); //crawling further would evict what was just prefetched
+					}
+					if (++directories % 100 == 0 || queue.empty())
+						mtp::debug("prefetched ", directories, " directories, ", queue.size(), " queued");
+				}
+				catch(const mtp::usb::DeviceNotFoundException &ex)
+				{
+					mtp::error("prefetch stopped, device disconnected");
+					queue.clear(); //restarted after reconnect
+				}
+				catch(const std::exception &ex)
+				{ mtp::debug("prefetching inode ", inode.Inode, " failed: ", ex.what()); }
+				l.unlock();
+				std::this_thread::yield();
+			}
+		}
+
+		bool FillEntry(FuseEntry &entry, FuseId id)
+		{
+			try { entry.attr = GetObjectAttr(id); } catch(const std::exception &ex) { return false; }
+			entry.SetId(id);
+			return true;
+		}
+
+		void LookupControl(FuseEntry &entry, FuseId parent, const char *name)
+		{
+			int index = parent == FuseId::Root? ControlDirectory: ControlFileCount;
+			if (parent == ToControl(ControlDirectory))
+			{
+				for(int i = ControlDirectory + 1; i < ControlFileCount; ++i)
+					if (strcmp(name, ControlFiles[i].Name) == 0)
+						index = i;
+			}
+			if (index != ControlFileCount && FillEntry(entry, ToControl(static_cast<ControlFileIndex>(index))))
+				entry.Reply();
+			else
+				entry.ReplyError(ENOENT);
+		}
+
+		void ReadControlDirectory(FuseDirectory &dir, FuseId ino, off_t off)
+		{
+			if (ino != ToControl(ControlDirectory))
+			{
+				FUSE_CALL(fuse_reply_err(dir.GetRequest(), ENOTDIR));
+				return;
+			}
+			if (AddDotEntries(dir, ino, off))
+			{
+				for(int i = ControlDirectory + 1; i < ControlFileCount; ++i)
+				{
+					off_t next = DirectoryStream::FirstEntryCookie + i;
+					if (off >= next)
+						continue;
+					struct stat attr;
+					GetCachedObjectAttr(ToControl(static_cast<ControlFileIndex>(i)), attr);
+					if (!dir.Add(ControlFiles[i].Name, attr, true, next))
+						break;
+				}
+			}
+			dir.Reply();
+		}
+
+		std::string FormatStatistics()
+		{
+			std::stringstream ss;
+			ss << _statistics.Format() << "\n";
+			mtp::u64 hits = _cacheHits.load(), misses = _cacheMisses.load();
+			ss << "bytes read: " << _statistics.BytesRead.load() << ", written: " << _statistics.BytesWritten.load() << "\n";
+			ss << "merged reads: " << _statistics.MergedReads.load() << "\n";
+			ss << "cache hits: " << hits << ", misses: " << misses;
+			if (hits + misses)
+				ss << ", hit ratio: " << hits * 100 / (hits + misses) << "%";
+			ss << ", evictions: " << _cacheEvictions.load() << "\n";
+			{
+				SharedLock l(_cacheMutex);
+				ss << "cache memory: " << _cacheMemory / 1024 << " KiB";
+				if (GetCacheMemoryLimit())
+					ss << " of " << GetCacheMemoryLimit() / 1024 << " KiB";
+				ss << ", directories: " << _files.size() << ", objects: " << _objectAttrs.Size() << ", locations: " << _objectLocations.Size() << "\n";
+			}
+			ss << "read-ahead: " << _maxReadAhead / 1024 << " KiB, open files: " << _fileHandles.size();
+			ss << ", write buffers: " << _writeBuffers.size() << " (" << _writeBuffersSize / 1024 << " KiB)\n";
+			return ss.str();
+		}
+
+		void OpenControl(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			mode_t mode = ControlFiles[ino.Inode - ControlShift].Mode;
+			int access = fi->flags & O_ACCMODE;
+			if (S_ISDIR(mode))
+			{
+				FUSE_CALL(fuse_reply_err(req, EISDIR));
+				return;
+			}
+			if ((access != O_WRONLY && !(mode & S_IRUSR)) || (access != O_RDONLY && !(mode & S_IWUSR)))
+			{
+				FUSE_CALL(fuse_reply_err(req, EACCES));
+				return;
+			}
+
+			FileHandle file(ino);
+			std::string text; //contents are snapshot at open, so reads at any offset are consistent
+			if (ino == ToControl(ControlStats))
+				text = FormatStatistics();
+			else if (ino == ToControl(ControlReadAhead))
+				text = std::to_string(_maxReadAhead / 1024) + "\n";
+			file.ReadBuffer.assign(text.begin(), text.end());
+
+			fi->fh = ++_nextFileHandle;
+			fi->direct_io = 1; //size reported by getattr is zero
+			_fileHandles.insert(std::make_pair(fi->fh, file));
+			FUSE_CALL(fuse_reply_open(req, fi));
+		}
+
+		///resolves path relative to mount root, caller must hold device lock
+		FuseId ResolvePath(const std::string &path)
+		{
+			FuseId inode = FuseId::Root;
+			size_t begin = 0;
+			while(begin < path.size())
+			{
+				size_t end = path.find('/', begin);
+				if (end == path.npos)
+					end = path.size();
+				std::string name = path.substr(begin, end - begin);
+				begin = end + 1;
+				if (name.empty() || name == ".")
+					continue;
+
+				mtp::u64 child;
+				if (!GetChildren(inode).Find(name, child))
+					throw std::runtime_error("no such file or directory: " + path);
+				inode = FuseId(child);
+			}
+			return inode;
+		}
+
+		void RequestPrefetch(FuseId inode)
+		{
+			{
+				std::unique_lock<std::mutex> l(_prefetchMutex);
+				_prefetchRequests.push_back(inode);
+			}
+			_prefetchCondition.notify_all();
+			if (!_prefetchThread.joinable())
+				_prefetchThread = std::thread(&FuseWrapper::Prefetch, this);
+		}
+
+		void DropCaches()
+		{
+			FinishUploads();
+			FlushAllWrites();
+			{
+				ExclusiveLock l(_cacheMutex);
+				_files.clear();
+				_objectAttrs.Clear();
+				_directoryUsage.clear();
+				_cacheMemory = 0;
+			}
+			for(auto &i : _fileHandles)
+				if (!IsControl(i.second.Inode))
+					i.second.Invalidate();
+			_storageSpace.clear();
+			mtp::debug("dropped caches");
+		}
+
+		///handles commands written to /.aft files, caller must hold device lock
+		void WriteControl(fuse_req_t req, FuseId ino, const std::string &data)
+		{
+			size_t begin = data.find_first_not_of(" \t\r\n");
+			size_t end = data.find_last_not_of(" \t\r\n");
+			std::string value = begin != data.npos? data.substr(begin, end - begin + 1): std::string();
+
+			if (ino == ToControl(ControlDropCaches))
+				DropCaches();
+			else if (ino == ToControl(ControlPrefetch))
+			{
+				FuseId inode = FuseId::Root;
+				try { inode = ResolvePath(value); }
+				catch(const std::exception &ex)
+				{
+					mtp::debug("prefetch request failed: ", ex.what());
+					FUSE_CALL(fuse_reply_err(req, ENOENT));
+					return;
+				}
+				RequestPrefetch(inode);
+			}
+			else if (ino == ToControl(ControlReadAhead))
+			{
+				char *valueEnd = NULL;
+				unsigned long kib = strtoul(value.c_str(), &valueEnd, 10);
+				if (value.empty() || *valueEnd)
+				{
+					FUSE_CALL(fuse_reply_err(req, EINVAL));
+					return;
+				}
+				_maxReadAhead = std::min<size_t>(std::max<size_t>(kib * 1024, size_t(FileHandle::MinReadAhead)), size_t(MaxReadAheadLimit));
+				mtp::debug("read-ahead set to ", _maxReadAhead / 1024, " KiB");
+			}
+			else
+			{
+				FUSE_CALL(fuse_reply_err(req, EACCES));
+				return;
+			}
+			FUSE_CALL(fuse_reply_write(req, data.size()));
+		}
+
+	public:
+		fs::Statistics & GetStatistics()
+		{ return _statistics; }
+
+		FuseWrapper(const MountOptions &options, const std::string &serial = std::string()): _options(options), _serial(serial), _connectGeneration(0), _prefetchStop(false), _notifyChannel(NULL), _invalidateStop(false), _readServing(false), _useClock(0), _cacheMemory(0), _cacheHits(0), _cacheMisses(0), _cacheEvictions(0), _writeBuffersSize(0), _nextFileHandle(0), _spliceRead(false), _maxReadAhead(FileHandle::DefaultMaxReadAhead)
+		{ Connect(); }
+
+		~FuseWrapper()
+		{
+			{
+				std::unique_lock<std::mutex> l(_prefetchMutex);
+				_prefetchStop = true;
+			}
+			_prefetchCondition.notify_all();
+			if (_prefetchThread.joinable())
+				_prefetchThread.join();
+			StopInvalidations();
+			mtp::debug("cache hits: ", _cacheHits.load(), ", misses: ", _cacheMisses.load(), ", evictions: ", _cacheEvictions.load());
+		}
+
+		///sets channel for kernel cache notifications, call before session loop
+		void SetNotifyChannel(NotifyChannel *channel)
+		{ _notifyChannel = channel; }
+
+		///stops delivering notifications, must be called before notify channel is destroyed
+		void StopInvalidations()
+		{
+			{
+				std::unique_lock<std::mutex> l(_invalidateMutex);
+				_invalidateStop = true;
+			}
+			_invalidateCondition.notify_all();
+			if (_invalidateThread.joinable())
+				_invalidateThread.join();
+		}
+
+		///drops kernel page cache of file, delivered from separate thread as notifications must not run inside related request
+		void InvalidatePageCache(FuseId inode)
+		{
+			{
+				std::unique_lock<std::mutex> l(_invalidateMutex);
+				_invalidateQueue.push_back(inode);
+			}
+			_invalidateCondition.notify_one();
+		}
+
+		void DeliverInvalidations()
+		{
+			std::unique_lock<std::mutex> l(_invalidateMutex);
+			while(true)
+			{
+				_invalidateCondition.wait(l, [this]() { return _invalidateStop || !_invalidateQueue.empty(); });
+				if (_invalidateStop)
+					return;
+
+				FuseId inode = _invalidateQueue.front();
+				_invalidateQueue.pop_front();
+				l.unlock(); //kernel may wait for reads needing this lock while invalidating pages
+				int r = _notifyChannel? fuse_lowlevel_notify_inval_inode(_notifyChannel, inode.Inode, 0, 0): 0;
+				if (r != 0 && r != -ENOENT)
+					mtp::debug("invalidating page cache of inode ", inode.Inode, " failed: ", r);
+				l.lock();
+			}
+		}
+
+		///records attributes kernel page cache was filled with, invalidates it if refresh shows object changed. caller must hold _mutex
+		void CheckPageCache(mtp::ObjectId id, const struct stat &attr)
+		{
+			auto i = _pageCache.find(ToFuse(id));
+			if (i == _pageCache.end() || (mtp::s64(i->second.Size) == attr.st_size && i->second.Mtime == attr.st_mtime))
+				return;
+			mtp::debug("object ", id.Id, " changed on device, dropping its page cache");
+			_pageCache.erase(i);
+			InvalidatePageCache(ToFuse(id));
+		}
+
+		void Connect()
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+
+			_uploads.clear();
+			_openedFiles.clear();
+			{
+				ExclusiveLock l(_cacheMutex);
+				++_connectGeneration;
+				_files.clear();
+				_objectAttrs.Clear();
+				_objectLocations.Clear();
+				_directoryUsage.clear();
+				_cacheMemory = 0;
+			}
+			for(auto &i : _fileHandles)
+				if (!IsControl(i.second.Inode))
+					i.second.Invalidate();
+			for(auto &i : _pageCache)
+				InvalidatePageCache(i.first); //device might have been changed while disconnected
+			_pageCache.clear();
+			_storageSpace.clear();
+			_session.reset();
+			_device.reset();
+			if (_serial.empty())
+			{
+				_device = mtp::Device::Find();
+				if (!_device)
+					throw std::runtime_error("no MTP device found");
+				_session = _device->OpenSession(1);
+			}
+			else
+			{
+				for(auto &device : mtp::Device::FindAll())
+				{
+					mtp::SessionPtr session = device->OpenSession(1);
+					if (session->GetDeviceInfo().SerialNumber != _serial)
+						continue;
+					_device = device;
+					_session = session;
+					break;
+				}
+				if (!_session)
+					throw std::runtime_error("device " + _serial + " not found");
+			}
+			_editObjectSupported = _session->EditObjectSupported();
+			if (!_editObjectSupported)
+				mtp::error("your device does not have android EditObject extension, mounting read-only\n");
+			_getObjectPropertyListSupported = _session->GetObjectPropertyListSupported();
+			if (!_getObjectPropertyListSupported)
+				mtp::error("your device does not have GetObjectPropertyList extension, expect slow enumeration of big directories\n");
+
+			//overlay loading does file i/o, keep it out of cache lock
+			MtimeOverlay mtimeOverlay;
+			mtimeOverlay.Load(_session->GetDeviceInfo().SerialNumber);
+			{
+				ExclusiveLock l(_cacheMutex);
+				_connectTime = time(NULL);
+				_dateModifiedWritable = true;
+				std::swap(_mtimeOverlay, mtimeOverlay);
+			}
+			_thumbnails.Open(_session->GetDeviceInfo().SerialNumber);
+			_thumbnailIds.clear();
+
+			_persistentKeys.clear();
+			if (_options.PersistentCache)
+			{
+				std::string path = fs::GetCachePath(_session->GetDeviceInfo().SerialNumber, ".tree");
+				if (!_getObjectPropertyListSupported)
+					mtp::error("persistent cache requires GetObjectPropertyList, disabled");
+				else if (!path.empty())
+					_persistentCache.Open(path);
+			}
+			PopulateStorages();
+		}
+
+		///checks whether device is still attached with a cheap transaction, skipped while device is busy
+		bool Probe()
+		{
+			std::unique_lock<std::mutex> l(_mutex, std::try_to_lock);
+			if (!l.owns_lock() || !_uploads.empty())
+				return true;
+			if (!_session)
+				return false;
+			try
+			{ _session->GetStorageIDs(); }
+			catch(const mtp::usb::DeviceNotFoundException &)
+			{ return false; }
+			catch(const std::exception &ex)
+			{ mtp::debug("probe failed: ", ex.what()); }
+			return true;
+		}
+
+		///sets this device's share of cache memory budget
+		void SetCacheMemoryLimit(unsigned mib)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			_options.CacheMemory = mib;
+			EnforceCacheLimit();
+		}
+
+		void Recover()
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			_uploads.clear(); //cancel interrupted data phases, objects stay truncated
+			_session->Recover();
+			_openedFiles.clear(); //edit sessions might not survive device reset, reopen them on demand
+		}
+
+		void PopulateStorages()
+		{
+			_storageIdList.clear();
+			_storageFromName.clear();
+			_storageToName.clear();
+			mtp::msg::StorageIDs ids = _session->GetStorageIDs();
+			_storageIdList.reserve(ids.StorageIDs.size());
+			for(size_t i = 0; i < ids.StorageIDs.size(); ++i)
+			{
+				mtp::StorageId id = ids.StorageIDs[i];
+				mtp::msg::StorageInfo si = _session->GetStorageInfo(id);
+				std::string path = (!si.StorageDescription.empty()? si.StorageDescription:  si.VolumeLabel);
+				if (path.empty())
+				{
+					char buf[64];
+					snprintf(buf, sizeof(buf), "sdcard%u", (unsigned)i);
+					path = buf;
+				}
+				FuseId inode(MtpStorageShift + i);
+				_storageIdList.push_back(id);
+				_storageFromName[path] = id;
+				_storageToName[id] = path;
+			}
+		}
+
+		void Init(void *, fuse_conn_info *conn)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+#ifdef FUSE_CAP_BIG_WRITES
+			conn->want |= conn->capable & FUSE_CAP_BIG_WRITES; //big writes, always on in fuse 3
+#endif
+#if FUSE_USE_VERSION >= 30
+			conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+			conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO; //attributes are cached anyway, use readdirplus for every call
+#endif
+			static const size_t MaxWriteSize = 1024 * 1024;
+			if (conn->max_write < MaxWriteSize)
+				conn->max_write = MaxWriteSize;
+			_spliceRead = (conn->capable & FUSE_CAP_SPLICE_WRITE) != 0;
+			conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+			if (_options.KeepCache && !_invalidateThread.joinable())
+				_invalidateThread = std::thread(&FuseWrapper::DeliverInvalidations, this);
+			if (_options.Prefetch && !_prefetchThread.joinable())
+				_prefetchThread = std::thread(&FuseWrapper::Prefetch, this); //started after fuse_daemonize, threads do not survive fork
+		}
+
+		void Lookup (fuse_req_t req, FuseId parent, const char *name)
+		{
+			FuseEntry entry(req);
+			if (IsControl(parent) || (parent == FuseId::Root && strcmp(name, ControlFiles[ControlDirectory].Name) == 0))
+			{
+				LookupControl(entry, parent, name);
+				return;
+			}
+			if (parent != FuseId::Root) //storage list is refreshed on every lookup
+			{
+				bool found = false, cached = false;
+				{
+					SharedLock l(_cacheMutex);
+					auto children = _files.find(parent);
+					if (children != _files.end())
+					{
+						Touch(parent);
+						mtp::u64 child;
+						cached = !children->second.Find(name, child) || (found = GetCachedObjectAttr(FuseId(child), entry.attr));
+						if (found)
+							entry.SetId(FuseId(child));
+					}
+				}
+				if (cached)
+					++_cacheHits;
+				if (found)
+				{
+					entry.Reply();
+					return;
+				}
+				if (cached)
+				{
+					entry.ReplyNegative();
+					return;
+				}
+			}
+
+			mtp::scoped_mutex_lock l(_mutex);
+			const fs::DirectoryEntries & children = GetChildren(parent);
+			mtp::u64 child;
+			if (!children.Find(name, child))
+			{
+				if (parent != FuseId::Root)
+					entry.ReplyNegative();
+				else
+					entry.ReplyError(ENOENT); //storages come and go with cards and unlocking
+			}
+			else if (FillEntry(entry, FuseId(child)))
+				entry.Reply();
+			else
+				entry.ReplyError(ENOENT);
+			EnforceCacheLimit();
+		}
+
+		void OpenDir(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			unsigned generation;
+			{
+				SharedLock l(_cacheMutex);
+				generation = _connectGeneration;
+			}
+			fi->fh = reinterpret_cast<uint64_t>(new DirectoryStream(generation));
+			FUSE_CALL(fuse_reply_open(req, fi));
+		}
+
+		void ReleaseDir(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			delete reinterpret_cast<DirectoryStream *>(fi->fh);
+			FUSE_CALL(fuse_reply_err(req, 0));
+		}
+
+		///returns parent for ".." without device access, caller must hold either lock
+		FuseId GetCachedParent(FuseId inode) const
+		{
+			FuseId parent = FuseId::Root;
+			if (IsControl(inode))
+				return inode == ToControl(ControlDirectory)? FuseId::Root: ToControl(ControlDirectory);
+			if (inode != FuseId::Root && !IsStorage(inode))
+				GetCachedParent(FromFuse(inode), parent);
+			return parent;
+		}
+
+		bool AddDotEntries(FuseDirectory &dir, FuseId ino, off_t off)
+		{
+			struct stat attr = { };
+			attr.st_mode = S_IFDIR;
+			attr.st_ino = ino.Inode;
+			if (off < 1 && !dir.Add(".", attr, false, 1))
+				return false;
+			attr.st_ino = GetCachedParent(ino).Inode;
+			if (off < 2 && !dir.Add("..", attr, false, 2))
+				return false;
+			return true;
+		}
+
+		///lists published directory in name order, caller must hold either lock
+		void ReplyDirectory(FuseDirectory &dir, FuseId ino, DirectoryStream &stream, const fs::DirectoryEntries &entries, off_t off)
+		{
+			if (AddDotEntries(dir, ino, off))
+			{
+				size_t index = 0;
+				if (off >= DirectoryStream::FirstEntryCookie)
+					index = (off == stream.Offset && !stream.LastName.empty())? entries.UpperBound(stream.LastName): off - DirectoryStream::FirstEntryCookie + 1;
+
+				off_t cookie = std::max<off_t>(off, DirectoryStream::FirstEntryCookie - 1);
+				for(; index < entries.Size(); ++index)
+				{
+					FuseId child(entries.GetInode(index));
+					struct stat attr;
+					bool valid = GetCachedObjectAttr(child, attr);
+					if (!valid)
+					{
+						struct stat empty = { };
+						attr = empty;
+						attr.st_ino = child.Inode;
+						attr.st_mode = FuseEntry::FileMode;
+					}
+					std::string name = entries.GetName(index);
+					if (!dir.Add(name, attr, valid, cookie + 1))
+						break;
+					stream.Offset = ++cookie;
+					stream.LastName.swap(name);
+				}
+			}
+		}
+
+		///lists directory in device order, fetching object info only as far as reply buffer reaches
+		void ReplyEnumeratedDirectory(FuseDirectory &dir, FuseId ino, DirectoryStream &stream, off_t off)
+		{
+			if (AddDotEntries(dir, ino, off))
+			{
+				size_t index = off >= DirectoryStream::FirstEntryCookie? off - DirectoryStream::FirstEntryCookie + 1: 0;
+				while(true)
+				{
+					if (index < stream.Entries.size())
+					{
+						auto &entry = stream.Entries[index];
+						mtp::ObjectId id = FromFuse(entry.second);
+						auto attr = stream.Attrs.find(id);
+						bool valid = attr != stream.Attrs.end();
+						struct stat entryAttr = { };
+						if (valid)
+						{
+							entryAttr = attr->second;
+							ResolveMtimeOverlay(id, entryAttr);
+							_mtimeOverlay.Apply(id, entryAttr);
+						}
+						else
+						{
+							entryAttr.st_ino = entry.second.Inode;
+							entryAttr.st_mode = FuseEntry::FileMode;
+						}
+						if (!dir.Add(entry.first, entryAttr, valid, DirectoryStream::FirstEntryCookie + index))
+							break;
+						++index;
+						continue;
+					}
+					if (stream.Fetched >= stream.Handles.size())
+						break;
+
+					mtp::ObjectId id = stream.Handles[stream.Fetched++];
+					ChildrenObjects object;
+					try { GetObjectInfo(object, stream.Attrs, id); } catch(const std::exception &ex) { continue; }
+					if (!object.empty() && stream.Children.insert(*object.begin()).second)
+						stream.Entries.push_back(*object.begin());
+
+					if (stream.Fetched == stream.Handles.size())
+					{
+						if (IsStorage(ino))
+							AddPersistentKeys(ino, stream.Attrs);
+						UpdateCache(ino, stream.Children, stream.Attrs);
+						std::vector<mtp::ObjectId>().swap(stream.Handles);
+						stream.Fetched = 0;
+						mtp::debug("enumerated ", stream.Entries.size(), " objects");
+					}
+				}
+			}
+		}
+
+		///plus variant fills entries with attributes already fetched while listing, sparing lookup and getattr for each of them
+		void ReadDir(fuse_req_t req, FuseId ino, size_t size, off_t off, struct fuse_file_info *fi, bool plus)
+		{
+			FuseDirectory dir(req, size, plus);
+			if (IsControl(ino))
+			{
+				ReadControlDirectory(dir, ino, off);
+				return;
+			}
+			DirectoryStream &stream = *reinterpret_cast<DirectoryStream *>(fi->fh);
+			if (ino != FuseId::Root && !stream.Enumerating) //storage list is refreshed on rewind
+			{
+				SharedLock l(_cacheMutex);
+				auto files = _files.find(ino);
+				if (files != _files.end() && stream.Generation == _connectGeneration)
+				{
+					++_cacheHits;
+					Touch(ino);
+					ReplyDirectory(dir, ino, stream, files->second, off);
+					dir.Reply();
+					return;
+				}
+			}
+
+			mtp::scoped_mutex_lock l(_mutex);
+			if (!(GetObjectAttr(ino).st_mode & S_IFDIR))
+			{
+				FUSE_CALL(fuse_reply_err(req, ENOTDIR));
+				return;
+			}
+
+			if (off == 0 || stream.Generation != _connectGeneration)
+				stream.Reset(_connectGeneration);
+
+			if (!stream.Enumerating && (off == 0 || _files.find(ino) == _files.end()))
+			{
+				if (off == 0 && ino != FuseId::Root && _files.find(ino) == _files.end() && (IsStorage(ino) || !_getObjectPropertyListSupported))
+				{
+					++_cacheMisses;
+					FinishUploads();
+					stream.Enumerating = true;
+					stream.Handles = GetObjectHandles(ino).ObjectHandles;
+				}
+				else
+					GetChildren(ino);
+			}
+
+			if (stream.Enumerating)
+			{
+				FinishUploads();
+				ReplyEnumeratedDirectory(dir, ino, stream, off);
+			}
+			else
+				ReplyDirectory(dir, ino, stream, _files.at(ino), off);
+			dir.Reply();
+			EnforceCacheLimit();
+		}
+
+		void GetAttr(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			FuseEntry entry(req);
+			bool cached;
+			{
+				SharedLock l(_cacheMutex);
+				cached = GetCachedObjectAttr(ino, entry.attr);
+			}
+			if (cached)
+			{
+				++_cacheHits;
+				entry.SetId(ino);
+				entry.ReplyAttr();
+				return;
+			}
+
+			mtp::scoped_mutex_lock l(_mutex);
+			if (FillEntry(entry, ino))
+				entry.ReplyAttr();
+			else
+				entry.ReplyError(ENOENT);
+			EnforceCacheLimit();
+		}
+
+		mtp::Session::ObjectEditSessionPtr GetTransaction(FuseId inode)
+		{
+			mtp::Session::ObjectEditSessionPtr tr;
+			{
+				auto it = _openedFiles.find(inode);
+				if (it != _openedFiles.end())
+					tr = it->second;
+				else
+				{
+					FinishUploads();
+					tr = mtp::Session::EditObject(_session, FromFuse(inode));
+					_openedFiles[inode] = tr;
+				}
+			}
+			return NOT_NULL(tr);
+		}
+
+		///queues read, returns true if caller has to serve the queue with \ref NextReads and \ref Read
+		bool QueueRead(fuse_req_t req, FuseId ino, size_t size, off_t off, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_readMutex);
+			_readQueue.push_back(ReadRequest(req, ino, fi->fh, size, off));
+			if (_readServing)
+				return false;
+			_readServing = true;
+			return true;
+		}
+
+		///takes next group of overlapping or adjacent reads of the same file, returns false and stops serving when queue is empty
+		bool NextReads(ReadRequests &reads)
+		{
+			mtp::scoped_mutex_lock l(_readMutex);
+			reads.clear();
+			if (_readQueue.empty())
+			{
+				_readServing = false;
+				return false;
+			}
+
+			std::sort(_readQueue.begin(), _readQueue.end());
+			auto first = _readQueue.begin(), last = first + 1;
+			off_t begin = first->Offset, end = begin + first->Size;
+			for(; last != _readQueue.end() && last->Inode == first->Inode && last->Offset <= end; ++last)
+			{
+				off_t lastEnd = std::max<off_t>(end, last->Offset + last->Size);
+				if (lastEnd - begin > off_t(MaxMergedRead))
+					break;
+				end = lastEnd;
+			}
+			reads.assign(first, last);
+			_readQueue.erase(first, last);
+			return true;
+		}
+
+		///serves group of reads returned by \ref NextReads with single device transaction, skips already replied requests when retried
+		void Read(ReadRequests &reads)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			const ReadRequest &first = reads.front();
+			FuseId ino = first.Inode;
+			auto it = _fileHandles.find(first.Handle);
+			bool sequential = IsControl(ino) || (it != _fileHandles.end() && (first.Offset == it->second.NextReadOffset ||
+				(it->second.Pipe && it->second.Pipe->Contains(first.Offset, 1)) || it->second.IsBuffered(first.Offset, 1)));
+			if (reads.size() == 1 || sequential)
+			{
+				//sequential reads are served from growing read-ahead buffer
+				for(auto &r : reads)
+				{
+					if (r.Replied)
+						continue;
+					Read(r.Request, r.Inode, r.Size, r.Offset, r.Handle);
+					r.Replied = true;
+				}
+				return;
+			}
+
+			FlushWrites(ino);
+			ReleaseTransaction(ino);
+			struct stat attr = GetObjectAttr(ino);
+			off_t begin = first.Offset, end = begin;
+			for(auto &r : reads)
+				end = std::max<off_t>(end, r.Offset + r.Size);
+			end = std::min<off_t>(end, attr.st_size);
+
+			mtp::ByteArray data;
+			if (end > begin)
+			{
+				FinishUploads();
+				data = _session->GetPartialObject(FromFuse(ino), begin, end - begin);
+			}
+			mtp::debug("merged ", reads.size(), " reads into ", data.size(), " bytes at ", begin);
+
+			for(auto &r : reads)
+			{
+				if (r.Replied)
+					continue;
+				size_t offset = std::min<size_t>(r.Offset - begin, data.size());
+				size_t n = std::min(r.Size, data.size() - offset);
+				_statistics.BytesRead += n;
+				++_statistics.MergedReads;
+				FUSE_CALL(fuse_reply_buf(r.Request, n? static_cast<char *>(static_cast<void *>(data.data() + offset)): NULL, n));
+				r.Replied = true;
+				auto handle = _fileHandles.find(r.Handle);
+				if (handle != _fileHandles.end())
+					handle->second.NextReadOffset = r.Offset + n;
+			}
+
+			auto last = _fileHandles.find(reads.back().Handle);
+			if (last != _fileHandles.end())
+			{
+				FileHandle &file = last->second;
+				file.Pipe.reset();
+				file.ReadBuffer = std::move(data);
+				file.ReadOffset = begin;
+			}
+		}
+
+		///serves single read, caller must hold _mutex
+		void Read(fuse_req_t req, FuseId ino, size_t size, off_t begin, uint64_t handle)
+		{
+			if (IsControl(ino))
+			{
+				auto it = _fileHandles.find(handle);
+				size_t available = it != _fileHandles.end()? it->second.ReadBuffer.size(): 0;
+				size_t offset = std::min<size_t>(begin, available);
+				size_t n = std::min(size, available - offset);
+				FUSE_CALL(fuse_reply_buf(req, n? static_cast<char *>(static_cast<void *>(it->second.ReadBuffer.data() + offset)): NULL, n));
+				return;
+			}
+			FlushWrites(ino);
+			ReleaseTransaction(ino);
+			struct stat attr = GetObjectAttr(ino);
+			off_t rsize = std::min<off_t>(attr.st_size - begin, size);
+			mtp::debug("reading ", rsize, " bytes");
+
+			auto it = _fileHandles.find(handle);
+			if (rsize <= 0 || it == _fileHandles.end())
+			{
+				mtp::ByteArray data;
+				if (rsize > 0)
+				{
+					FinishUploads();
+					data = _session->GetPartialObject(FromFuse(ino), begin, rsize);
+				}
+				mtp::debug("read", data.size(), "bytes of data");
+				_statistics.BytesRead += data.size();
+				FUSE_CALL(fuse_reply_buf(req, static_cast<char *>(static_cast<void *>(data.data())), data.size()));
+				return;
+			}
+
+			FileHandle &file = it->second;
+			if (file.Pipe && file.Pipe->Contains(begin, rsize))
+			{
+				ReplyPipe(req, file, rsize);
+				return;
+			}
+			if (!file.IsBuffered(begin, rsize))
+			{
+				FinishUploads();
+				off_t fetchSize = std::min<off_t>(file.GetFetchSize(begin, rsize, _maxReadAhead), attr.st_size - begin);
+				if (_spliceRead && fetchSize > rsize)
+				{
+					//sequential read, stream read-ahead into a pipe and splice it out request by request
+					PipeBufferPtr pipe = file.Pipe && file.Pipe->Size == 0? file.Pipe: std::make_shared<PipeBuffer>(_maxReadAhead);
+					if (size_t(rsize) <= pipe->GetCapacity())
+					{
+						fetchSize = std::min<off_t>(fetchSize, pipe->GetCapacity());
+						pipe->Offset = begin;
+						file.Pipe = pipe;
+						file.ReadBuffer.clear();
+						_session->GetPartialObject(FromFuse(ino), begin, mtp::u64(fetchSize), std::make_shared<PipeOutputStream>(pipe));
+						mtp::debug("read ahead ", pipe->Size, " bytes into pipe");
+						//object may have shrunk since attributes were cached, never splice more than was fetched
+						ReplyPipe(req, file, std::min<size_t>(rsize, pipe->Size));
+						return;
+					}
+				}
+				file.Pipe.reset();
+				file.ReadBuffer = _session->GetPartialObject(FromFuse(ino), begin, fetchSize);
+				file.ReadOffset = begin;
+				mtp::debug("read ahead ", file.ReadBuffer.size(), " bytes");
+			}
+			file.NextReadOffset = begin + rsize;
+
+			size_t offset = begin - file.ReadOffset;
+			size_t n = std::min<size_t>(rsize, file.ReadBuffer.size() - offset);
+			_statistics.BytesRead += n;
+			FUSE_CALL(fuse_reply_buf(req, static_cast<char *>(static_cast<void *>(file.ReadBuffer.data() + offset)), n));
+		}
+
+		void ReplyPipe(fuse_req_t req, FileHandle &file, size_t size)
+		{
+			PipeBufferPtr pipe = file.Pipe;
+			struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+			buf.buf[0].flags = FUSE_BUF_IS_FD;
+			buf.buf[0].fd = pipe->GetReadFd();
+			pipe->Offset += size;
+			pipe->Size -= size;
+			file.NextReadOffset = pipe->Offset;
+			_statistics.BytesRead += size;
+			int r = fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+			if (r != 0)
+				file.Pipe.reset(); //unknown amount of data left in pipe
+			FUSE_CALL(r);
+		}
+
+		void Write(fuse_req_t req, FuseId inode, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			if (IsControl(inode))
+			{
+				WriteControl(req, inode, std::string(buf, size));
+				return;
+			}
+			_statistics.BytesWritten += size;
+
+			auto upload = _uploads.find(inode);
+			if (upload != _uploads.end())
+			{
+				if (off == upload->second->GetOffset())
+				{
+					try { upload->second->Write(buf, size); }
+					catch(const std::exception &) { _uploads.erase(upload); throw; }
+					ExclusiveLock l(_cacheMutex);
+					SetCachedObjectSize(FromFuse(inode), upload->second->GetOffset());
+					FUSE_CALL(fuse_reply_write(req, size));
+					return;
+				}
+				mtp::debug("out of order write at ", off, ", finishing streaming upload");
+				FinishUpload(inode);
+			}
+			if (!_editObjectSupported)
+			{
+				//streaming upload was ended out of order or by other request, there is no way to continue it
+				mtp::error("cannot write to ", inode.Inode, ", device does not support editing objects");
+				FUSE_CALL(fuse_reply_err(req, EIO));
+				return;
+			}
+
+			struct stat attr = GetObjectAttr(inode);
+			mtp::ObjectId objectId = FromFuse(inode);
+			InvalidateReadBuffers(inode);
+
+			WriteBuffer &buffer = _writeBuffers.insert(std::make_pair(inode, WriteBuffer(attr.st_size))).first->second;
+			size_t oldSize = buffer.Size;
+			buffer.Add(off, buf, size);
+			_writeBuffersSize += buffer.Size - oldSize;
+			{
+				ExclusiveLock l(_cacheMutex);
+				SetCachedObjectSize(objectId, buffer.FileSize);
+			}
+
+			if (buffer.Size >= WriteBackThreshold)
+				FlushWrites(inode);
+			else if (_writeBuffersSize >= WriteBackMemoryLimit)
+				FlushAllWrites();
+
+			FUSE_CALL(fuse_reply_write(req, size));
+		}
+
+		void MakeNode(fuse_req_t req, FuseId parent, const char *name, mode_t mode, dev_t rdev)
+		{ mtp::scoped_mutex_lock l(_mutex); CreateObject(mtp::ObjectFormat::Undefined, req, parent, name, mode); }
+
+		void MakeDir(fuse_req_t req, FuseId parent, const char *name, mode_t mode)
+		{ mtp::scoped_mutex_lock l(_mutex); CreateObject(mtp::ObjectFormat::Association, req, parent, name, mode); }
+
+		void Create(fuse_req_t req, FuseId parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			if (parent == FuseId::Root || IsControl(parent))
+			{
+				FUSE_CALL(fuse_reply_err(req, EPERM)); //cannot create files in the same level with storages
+				return;
+			}
+			FinishUploads();
+
+			mtp::ObjectId parentId;
+			mtp::StorageId storageId;
+			GetParentIds(parent, storageId, parentId);
+
+			mtp::msg::ObjectInfo oi;
+			oi.Filename = name;
+			oi.ObjectFormat = mtp::ObjectFormatFromFilename(name);
+			oi.SetSize(mtp::MaxObjectSize);
+
+			FuseEntry entry(req);
+			mtp::Session::NewObjectInfo noi;
+			try
+			{ noi = _session->SendObjectInfo(oi, storageId, parentId); }
+			catch(const mtp::InvalidResponseException &ex)
+			{
+				mtp::debug("object of unknown size refused, creating empty one: ", ex.what());
+				FuseId inode = CreateObject(parent, name, mtp::ObjectFormat::Undefined);
+				entry.SetId(inode);
+				entry.attr = GetObjectAttr(inode);
+				fi->fh = ++_nextFileHandle;
+				_fileHandles.insert(std::make_pair(fi->fh, FileHandle(inode)));
+				FUSE_CALL(fuse_reply_create(req, &entry, fi));
+				return;
+			}
+
+			FuseId inode = ToFuse(noi.ObjectId);
+			mtp::debug("   streaming new object id ", noi.ObjectId.Id);
+			_uploads[inode] = std::make_shared<StreamingUpload>(_session);
+
+			//device is busy until upload is finished, fill caches locally
+			InvalidatePersistentCache(parent);
+			struct stat attr = { };
+			attr.st_ino = inode.Inode;
+			attr.st_mode = FuseEntry::FileMode;
+			attr.st_mtime = attr.st_ctime = attr.st_atime = time(NULL);
+			{
+				ExclusiveLock l(_cacheMutex);
+				SetCachedObjectAttr(noi.ObjectId, attr);
+				SetCachedLocation(noi.ObjectId, parent);
+				auto i = _files.find(parent);
+				if (i != _files.end())
+					i->second.Set(name, inode.Inode);
+			}
+
+			entry.SetId(inode);
+			entry.attr = attr;
+			fi->fh = ++_nextFileHandle;
+			_fileHandles.insert(std::make_pair(fi->fh, FileHandle(inode)));
+			FUSE_CALL(fuse_reply_create(req, &entry, fi));
+		}
+
+		void Open(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			if (IsControl(ino))
+			{
+				OpenControl(req, ino, fi);
+				return;
+			}
+			struct stat attr;
+			bool directory;
+			if (GetCachedObjectAttr(ino, attr))
+			{
+				FinishUpload(ino);
+				directory = S_ISDIR(attr.st_mode);
+			}
+			else
+			{
+				FinishUploads();
+				try
+				{
+					directory = static_cast<mtp::ObjectFormat>(_session->GetObjectIntegerProperty(FromFuse(ino), mtp::ObjectProperty::ObjectFormat)) == mtp::ObjectFormat::Association;
+				}
+				catch(const std::exception &ex)
+				{ FUSE_CALL(fuse_reply_err(req, ENOENT)); return; }
+			}
+
+			if (directory)
+			{
+				FUSE_CALL(fuse_reply_err(req, EISDIR));
+				return;
+			}
+			if (_options.KeepCache && GetCachedObjectAttr(ino, attr))
+			{
+				//page cache filled by previous opens is valid while object keeps its size and mtime
+				PageCacheState state = { mtp::u64(attr.st_size), attr.st_mtime };
+				auto pages = _pageCache.find(ino);
+				fi->keep_cache = pages != _pageCache.end() && pages->second.Size == state.Size && pages->second.Mtime == state.Mtime;
+				_pageCache[ino] = state;
+			}
+			fi->fh = ++_nextFileHandle;
+			_fileHandles.insert(std::make_pair(fi->fh, FileHandle(ino)));
+			FUSE_CALL(fuse_reply_open(req, fi));
+		}
+
+		void ReleaseTransaction(FuseId ino)
+		{
+			auto i = _openedFiles.find(ino);
+			if (i != _openedFiles.end())
+			{
+				FinishUploads();
+				_openedFiles.erase(i);
+			}
+		}
+
+		void Release(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			_fileHandles.erase(fi->fh);
+			FinishUpload(ino);
+			FlushWrites(ino);
+			ReleaseTransaction(ino);
+			FUSE_CALL(fuse_reply_err(req, 0));
+		}
+
+		void Flush(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			FinishUpload(ino);
+			FlushWrites(ino);
+			FUSE_CALL(fuse_reply_err(req, 0));
+		}
+
+		void FSync(fuse_req_t req, FuseId ino, int datasync, struct fuse_file_info *fi)
+		{
+			mtp::scoped_mutex_lock l(_mutex);
+			FinishUpload(ino);
+			FlushWrites(ino);
+			ReleaseTransaction(ino);
+			FUSE_CALL(fuse_reply_err(req, 0));
 		}
 
-		void Lookup (fuse_req_t req, FuseId parent, const char *name)
+		///serves device-generated thumbnail as user.mtp.thumbnail attribute, so previews do not read whole files
+		void GetXAttr(fuse_req_t req, FuseId ino, const char *name, size_t size)
 		{
-			mtp::scoped_mutex_lock l(_mutex);
-			FuseEntry entry(req);
+			if (strcmp(name, ThumbnailAttribute) != 0 || ino == FuseId::Root || IsStorage(ino) || IsControl(ino))
+			{
+				FUSE_CALL(fuse_reply_err(req, ENODATA));
+				return;
+			}
 
-			const ChildrenObjects & children = GetChildren(parent);
-			auto it = children.find(name);
-			if (it != children.end())
+			mtp::scoped_mutex_lock l(_mutex);
+			struct stat attr = GetObjectAttr(ino);
+			mtp::ObjectId id = FromFuse(ino);
+			mtp::ByteArray data;
+			if (!S_ISDIR(attr.st_mode))
 			{
-				if (FillEntry(entry, it->second))
+				auto persistentId = _thumbnailIds.find(id);
+				if (persistentId == _thumbnailIds.end())
 				{
-					entry.Reply();
-					return;
+					FinishUploads();
+					persistentId = _thumbnailIds.insert(std::make_pair(id, mtp::ByteArray())).first;
+					try { persistentId->second = _session->GetObjectProperty(id, mtp::ObjectProperty::PersistentUniqueObjectId); }
+					catch(const mtp::InvalidResponseException &ex)
+					{ mtp::debug("no persistent id for ", id.Id, ", thumbnail is not cached on disk: ", ex.what()); }
+				}
+				if (!_thumbnails.Get(id.Id, persistentId->second, attr.st_size, attr.st_mtime, data))
+				{
+					FinishUploads();
+					try { data = _session->GetThumb(id); }
+					catch(const mtp::InvalidResponseException &ex)
+					{ mtp::debug("no thumbnail for ", id.Id, ": ", ex.what()); } //not an image, or device does not generate thumbnails
+					_thumbnails.Put(id.Id, persistentId->second, attr.st_size, attr.st_mtime, data);
 				}
 			}
-			entry.ReplyError(ENOENT);
+
+			if (data.empty())
+				FUSE_CALL(fuse_reply_err(req, ENODATA));
+			else if (size == 0)
+				FUSE_CALL(fuse_reply_xattr(req, data.size()));
+			else if (size < data.size())
+				FUSE_CALL(fuse_reply_err(req, ERANGE));
+			else
+				FUSE_CALL(fuse_reply_buf(req, static_cast<char *>(static_cast<void *>(data.data())), data.size()));
 		}
 
-		void ReadDir(fuse_req_t req, FuseId ino, size_t size, off_t off, struct fuse_file_info *fi)
+		void Rename(fuse_req_t req, FuseId parent, const char *name, FuseId newparent, const char *newname, unsigned flags)
 		{
 			mtp::scoped_mutex_lock l(_mutex);
-			if (!(GetObjectAttr(ino).st_mode & S_IFDIR))
+			if (IsControl(parent) || IsControl(newparent))
 			{
-				FUSE_CALL(fuse_reply_err(req, ENOTDIR));
+				FUSE_CALL(fuse_reply_err(req, EPERM));
 				return;
 			}
-
-			FuseDirectory dir(req);
-			auto it = _directoryCache.find(ino);
-			if (it == _directoryCache.end())
+			if (flags & ~RENAME_NOREPLACE)
+			{
+				FUSE_CALL(fuse_reply_err(req, EINVAL)); //RENAME_EXCHANGE could not be done atomically
+				return;
+			}
+			if (parent == FuseId::Root || newparent == FuseId::Root)
 			{
-				const ChildrenObjects & cache = GetChildren(ino);
+				FUSE_CALL(fuse_reply_err(req, EPERM)); //storages could not be renamed
+				return;
+			}
+			FinishUploads();
 
-				it = _directoryCache.insert(std::make_pair(ino, CharArray())).first;
-				CharArray &data = it->second;
+			fs::DirectoryEntries &children = GetChildren(parent);
+			mtp::u64 child;
+			if (!children.Find(name, child))
+			{
+				FUSE_CALL(fuse_reply_err(req, ENOENT));
+				return;
+			}
+			FuseId inode(child);
+			mtp::ObjectId id = FromFuse(inode);
 
-				dir.Add(data, ".", GetObjectAttr(FuseId::Root));
-				dir.Add(data, "..", GetObjectAttr(GetParentObject(ino)));
-				for(auto entry : cache)
+			fs::DirectoryEntries &newChildren = GetChildren(newparent);
+			mtp::u64 target;
+			if (newChildren.Find(newname, target))
+			{
+				FuseId targetInode(target);
+				if (targetInode == inode)
 				{
-					dir.Add(data, entry.first, GetObjectAttr(entry.second));
+					FUSE_CALL(fuse_reply_err(req, 0));
+					return;
+				}
+				if (flags & RENAME_NOREPLACE)
+				{
+					FUSE_CALL(fuse_reply_err(req, EEXIST));
+					return;
 				}
+				if (GetObjectAttr(targetInode).st_mode & S_IFDIR)
+				{
+					FUSE_CALL(fuse_reply_err(req, EEXIST)); //deleting association removes its contents, don't replace directories
+					return;
+				}
+				mtp::debug("   replacing inode ", targetInode.Inode);
+				DiscardWrites(targetInode);
+				_openedFiles.erase(targetInode);
+				_session->DeleteObject(FromFuse(targetInode));
+				AdjustFreeSpace(FromFuse(targetInode), -mtp::s64(GetObjectAttr(targetInode).st_size));
+				_mtimeOverlay.Remove(FromFuse(targetInode));
+				ExclusiveLock l(_cacheMutex);
+				_objectAttrs.Erase(FromFuse(targetInode).Id);
+				_objectLocations.Erase(FromFuse(targetInode).Id);
+				_pageCache.erase(targetInode);
+				newChildren.Erase(newname);
 			}
 
-			dir.Reply(req, it->second, off, size);
-		}
+			FlushWrites(inode);
+			ReleaseTransaction(inode);
 
-		void GetAttr(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
-		{
-			mtp::scoped_mutex_lock l(_mutex);
-			FuseEntry entry(req);
-			if (FillEntry(entry, ino))
-				entry.ReplyAttr();
-			else
-				entry.ReplyError(ENOENT);
-		}
+			try
+			{
+				//rename in place first, so failed move leaves object where it was
+				if (strcmp(name, newname) != 0)
+					_session->SetObjectProperty(id, mtp::ObjectProperty::ObjectFilename, std::string(newname));
+			}
+			catch(const mtp::InvalidResponseException &ex)
+			{
+				mtp::debug("   rename refused: ", ex.what());
+				FUSE_CALL(fuse_reply_err(req, EXDEV)); //return cross-device link, so user space should re-create file and copy it
+				return;
+			}
 
-		mtp::Session::ObjectEditSessionPtr GetTransaction(FuseId inode)
-		{
-			mtp::Session::ObjectEditSessionPtr tr;
+			if (parent != newparent)
 			{
-				auto it = _openedFiles.find(inode);
-				if (it != _openedFiles.end())
-					tr = it->second;
-				else
+				mtp::StorageId storageId;
+				mtp::ObjectId parentId;
+				GetParentIds(newparent, storageId, parentId);
+				try
+				{ _session->MoveObject(id, storageId, parentId); }
+				catch(const mtp::InvalidResponseException &ex)
 				{
-					tr = mtp::Session::EditObject(_session, FromFuse(inode));
-					_openedFiles[inode] = tr;
+					mtp::debug("   move refused: ", ex.what());
+					if (strcmp(name, newname) != 0)
+					{
+						try { _session->SetObjectProperty(id, mtp::ObjectProperty::ObjectFilename, std::string(name)); }
+						catch(const std::exception &ex) { mtp::error("restoring name of ", name, " failed: ", ex.what()); }
+					}
+					FUSE_CALL(fuse_reply_err(req, EXDEV));
+					return;
 				}
 			}
-			return NOT_NULL(tr);
-		}
-
-		void Read(fuse_req_t req, FuseId ino, size_t size, off_t begin, struct fuse_file_info *fi)
-		{
-			mtp::scoped_mutex_lock l(_mutex);
-			ReleaseTransaction(ino);
-			struct stat attr = GetObjectAttr(ino);
-			off_t rsize = std::min<off_t>(attr.st_size - begin, size);
-			mtp::debug("reading ", rsize, " bytes");
-			mtp::ByteArray data;
-			if (rsize > 0)
-				data = _session->GetPartialObject(FromFuse(ino), begin, rsize);
-			mtp::debug("read", data.size(), "bytes of data");
-			FUSE_CALL(fuse_reply_buf(req, static_cast<char *>(static_cast<void *>(data.data())), data.size()));
-		}
 
-		void Write(fuse_req_t req, FuseId inode, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
-		{
-			mtp::scoped_mutex_lock l(_mutex);
-
-			struct stat attr = GetObjectAttr(inode);
-			mtp::ObjectId objectId = FromFuse(inode);
-
-			ObjectEditSessionPtr tr = GetTransaction(inode);
-
-			off_t newSize = off + size;
-			if (newSize > attr.st_size)
+			InvalidatePersistentCache(parent);
+			InvalidatePersistentCache(newparent);
 			{
-				mtp::debug("truncating file to ", newSize);
-				tr->Truncate(newSize);
-				_objectAttrs[objectId].st_size = newSize;
+				ExclusiveLock l(_cacheMutex);
+				children.Erase(name);
+				newChildren.Set(newname, inode.Inode);
+				SetCachedLocation(id, newparent);
 			}
-
-			tr->Send(off, mtp::ByteArray(buf, buf + size));
-			FUSE_CALL(fuse_reply_write(req, size));
+			FUSE_CALL(fuse_reply_err(req, 0));
 		}
 
-		void MakeNode(fuse_req_t req, FuseId parent, const char *name, mode_t mode, dev_t rdev)
-		{ mtp::scoped_mutex_lock l(_mutex); CreateObject(mtp::ObjectFormat::Undefined, req, parent, name, mode); }
-
-		void MakeDir(fuse_req_t req, FuseId parent, const char *name, mode_t mode)
-		{ mtp::scoped_mutex_lock l(_mutex); CreateObject(mtp::ObjectFormat::Association, req, parent, name, mode); }
-
-		void Open(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
+		void SetModificationTime(FuseId inode, time_t mtime)
 		{
-			mtp::scoped_mutex_lock l(_mutex);
-			mtp::ObjectFormat format;
+			FinishUploads();
+			FlushWrites(inode);
+			ReleaseTransaction(inode);
+			mtp::ObjectId id = FromFuse(inode);
 
-			try
+			bool set = false;
+			if (_dateModifiedWritable)
 			{
-				format = static_cast<mtp::ObjectFormat>(_session->GetObjectIntegerProperty(FromFuse(ino), mtp::ObjectProperty::ObjectFormat));
+				try
+				{
+					_session->SetObjectProperty(id, mtp::ObjectProperty::DateModified, mtp::ConvertDateTime(mtime));
+					_mtimeOverlay.Remove(id);
+					set = true;
+				}
+				catch(const mtp::InvalidResponseException &ex)
+				{
+					mtp::debug("   DateModified is read-only, using host-side overlay: ", ex.what());
+					_dateModifiedWritable = false;
+				}
 			}
-			catch(const std::exception &ex)
-			{ FUSE_CALL(fuse_reply_err(req, ENOENT)); return; }
-
-			if (format == mtp::ObjectFormat::Association)
+			if (!set)
 			{
-				FUSE_CALL(fuse_reply_err(req, EISDIR));
-				return;
+				try
+				{
+					mtp::ByteArray persistentId = _session->GetObjectProperty(id, mtp::ObjectProperty::PersistentUniqueObjectId);
+					time_t deviceMtime = mtp::ConvertDateTime(_session->GetObjectStringProperty(id, mtp::ObjectProperty::DateModified));
+					if (!persistentId.empty())
+						_mtimeOverlay.Set(id, persistentId, deviceMtime, GetObjectAttr(inode).st_size, mtime);
+				}
+				catch(const mtp::InvalidResponseException &ex)
+				{ mtp::debug("   no persistent id, modification time is kept in attribute cache only: ", ex.what()); }
 			}
-			FUSE_CALL(fuse_reply_open(req, fi));
-		}
-
-		void ReleaseTransaction(FuseId ino)
-		{
-			auto i = _openedFiles.find(ino);
-			if (i != _openedFiles.end())
-				_openedFiles.erase(i);
-		}
-
-		void Release(fuse_req_t req, FuseId ino, struct fuse_file_info *fi)
-		{
-			mtp::scoped_mutex_lock l(_mutex);
-			ReleaseTransaction(ino);
-		}
 
-		void Rename(fuse_req_t req, FuseId parent, const char *name, FuseId newparent, const char *newname)
-		{
-			fuse_reply_err(req, EXDEV); //return cross-device link, so user space should re-create file and copy it
+			ExclusiveLock l(_cacheMutex);
+			fs::ObjectAttributes *attrs = _objectAttrs.Find(id.Id);
+			if (attrs)
+				attrs->Mtime = mtime;
+			auto pages = _pageCache.find(inode);
+			if (pages != _pageCache.end())
+				pages->second.Mtime = mtime;
 		}
 
 		void SetAttr(fuse_req_t req, FuseId inode, struct stat *attr, int to_set, struct fuse_file_info *fi)
 		{
 			mtp::scoped_mutex_lock l(_mutex);
 			FuseEntry entry(req);
+			if (IsControl(inode) && FillEntry(entry, inode))
+			{
+				entry.ReplyAttr(); //truncation by shell redirection, control files have no contents to change
+				return;
+			}
 			if (FillEntry(entry, inode))
 			{
 				if (to_set & FUSE_SET_ATTR_SIZE)
 				{
 					off_t newSize = attr->st_size;
+					FinishUploads();
+					FlushWrites(inode);
 					ObjectEditSessionPtr tr = GetTransaction(inode);
+					InvalidateReadBuffers(inode);
 					tr->Truncate(newSize);
 					entry.attr.st_size = newSize;
-					_objectAttrs[FromFuse(inode)].st_size = newSize;
+					ExclusiveLock l(_cacheMutex);
+					SetCachedObjectSize(FromFuse(inode), newSize);
+				}
+				if ((to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) && inode != FuseId::Root && !IsStorage(inode))
+				{
+					time_t mtime = (to_set & FUSE_SET_ATTR_MTIME_NOW)? time(NULL): attr->st_mtime;
+					SetModificationTime(inode, mtime);
+					entry.attr.st_mtime = mtime;
 				}
 				entry.ReplyAttr();
 			}
@@ -724,21 +3174,41 @@ namespace
 		void Unlink(fuse_req_t req, FuseId parent, const char *name)
 		{
 			mtp::scoped_mutex_lock l(_mutex);
-			ChildrenObjects &children = GetChildren(parent);
-			auto i = children.find(name);
-			if (i == children.end())
+			if (IsControl(parent))
+			{
+				FUSE_CALL(fuse_reply_err(req, EPERM));
+				return;
+			}
+			FinishUploads();
+			fs::DirectoryEntries &children = GetChildren(parent);
+			mtp::u64 child;
+			if (!children.Find(name, child))
 			{
 				FUSE_CALL(fuse_reply_err(req, ENOENT));
 				return;
 			}
 
-			FuseId inode = i->second;
+			FuseId inode(child);
 			mtp::debug("   unlinking inode ", inode.Inode);
 			mtp::ObjectId id = FromFuse(inode);
-			_directoryCache.erase(parent);
+			DiscardWrites(inode);
 			_openedFiles.erase(inode);
-			_objectAttrs.erase(id);
-			children.erase(i);
+			InvalidatePersistentCache(parent);
+			InvalidatePersistentCache(inode);
+			_persistentKeys.erase(id);
+			struct stat attr;
+			if (GetCachedObjectAttr(inode, attr) && !S_ISDIR(attr.st_mode))
+				AdjustFreeSpace(id, -mtp::s64(attr.st_size));
+			else
+				InvalidateStorageSpace(id); //removing association frees its contents too
+			{
+				ExclusiveLock l(_cacheMutex);
+				_objectAttrs.Erase(id.Id);
+				_objectLocations.Erase(id.Id);
+				_pageCache.erase(inode);
+				children.Erase(name);
+				_mtimeOverlay.Remove(id);
+			}
 
 			_session->DeleteObject(id);
 			FUSE_CALL(fuse_reply_err(req, 0));
@@ -751,26 +3221,32 @@ namespace
 			stat.f_namemax = 254;
 
 			mtp::u64 freeSpace = 0, capacity = 0;
-			if (ino == FuseId::Root)
+			if (ino == FuseId::Root || IsControl(ino))
 			{
 				for(auto storageId : _storageIdList)
 				{
-					mtp::msg::StorageInfo si = _session->GetStorageInfo(storageId);
-					freeSpace += si.FreeSpaceInBytes;
-					capacity += si.MaxCapacity;
+					const StorageSpace &space = GetStorageSpace(storageId);
+					freeSpace += space.Free;
+					capacity += space.Capacity;
 				}
 			}
 			else
 			{
 				mtp::StorageId storageId;
+				FuseId storage(FuseId::Root);
 				if (IsStorage(ino))
 					storageId = FuseIdToStorageId(ino);
+				else if (GetCachedStorage(FromFuse(ino), storage) && IsStorage(storage))
+					storageId = FuseIdToStorageId(storage);
 				else
+				{
+					FinishUploads();
 					storageId = _session->GetObjectStorage(FromFuse(ino));
+				}
 
-				mtp::msg::StorageInfo si = _session->GetStorageInfo(storageId);
-				freeSpace = si.FreeSpaceInBytes;
-				capacity = si.MaxCapacity;
+				const StorageSpace &space = GetStorageSpace(storageId);
+				freeSpace = space.Free;
+				capacity = space.Capacity;
 			}
 
 			stat.f_frsize = stat.f_bsize = 1024 * 1024;
@@ -780,79 +3256,351 @@ namespace
 			FUSE_CALL(fuse_reply_statfs(req, &stat));
 		}
 	};
+	DECLARE_PTR(FuseWrapper);
+
+	std::unique_ptr<FuseWrapper>	g_wrapper; //single device mode
 
-	std::unique_ptr<FuseWrapper>	g_wrapper;
+	///returns wrapper of device the request came to, passed as session user data
+	FuseWrapper * GetWrapper(fuse_req_t req)
+	{ return static_cast<FuseWrapper *>(fuse_req_userdata(req)); }
 
-#define WRAP_EX(...) do { \
+	///restores device after failed request: resets timed out device, reconnects disconnected one. returns false if device is unusable
+	bool RecoverDevice(FuseWrapper *wrapper, bool reconnect)
+	{
+		try
+		{
+			if (!reconnect)
+			{
+				try { wrapper->Recover(); return true; }
+				catch (const std::exception &ex)
+				{ mtp::error("recovery failed, reconnecting: ", ex.what()); }
+			}
+			wrapper->Connect();
+			return true;
+		}
+		catch (const std::exception &ex)
+		{ mtp::error("reconnect failed: ", ex.what()); return false; }
+	}
+
+	//requests which may have replied or modified device before failing are not repeated after recovery
+#define WRAP_EX_IMPL(RETRY, ...) do { \
+		bool reconnect = false; \
 		try { return __VA_ARGS__ ; } \
+		catch (const mtp::usb::TimeoutException &ex) \
+		{ mtp::error(#__VA_ARGS__ " timed out, recovering: ", ex.what()); } \
 		catch (const mtp::usb::DeviceNotFoundException &) \
+		{ mtp::error(#__VA_ARGS__ " failed, device disconnected"); reconnect = true; } \
+		catch (const std::exception &ex) \
+		{ mtp::error(#__VA_ARGS__ " failed: ", ex.what()); fuse_reply_err(req, EIO); return; } \
+		if (RecoverDevice(GetWrapper(req), reconnect) && (RETRY)) \
 		{ \
-			g_wrapper->Connect(); \
-			__VA_ARGS__ ; \
+			try { return __VA_ARGS__ ; } \
+			catch (const std::exception &ex) \
+			{ mtp::error(#__VA_ARGS__ " failed after recovery: ", ex.what()); } \
 		} \
-		catch (const std::exception &ex) \
-		{ mtp::error(#__VA_ARGS__ " failed: ", ex.what()); fuse_reply_err(req, EIO); } \
+		fuse_reply_err(req, EIO); \
 	} while(false)
 
+#define WRAP_EX(...) WRAP_EX_IMPL(true, __VA_ARGS__)
+#define WRAP_EX_NO_RETRY(...) WRAP_EX_IMPL(false, __VA_ARGS__)
+
+#define TIME_OPERATION(OP) fs::OperationTimer timer(GetWrapper(req)->GetStatistics(), fs::Statistics::OP)
+
 	void Init (void *userdata, struct fuse_conn_info *conn)
 	{
 		mtp::debug("Init: fuse proto version: ", conn->proto_major, ".", conn->proto_minor,
 			", capability: 0x", mtp::hex(conn->capable, 8),
-			", async read: ", conn->async_read,
+			", async read: ", (conn->want & FUSE_CAP_ASYNC_READ) != 0,
 			//", congestion_threshold: ", conn->congestion_threshold,
 			//", max bg: ", conn->max_background,
 			", max readahead: ", conn->max_readahead, ", max write: ", conn->max_write
 		);
 
-		//If synchronous reads are chosen, Fuse will wait for reads to complete before issuing any other requests.
-		//mtp is completely synchronous. you cannot have two transaction in parallel, so you have to wait any operation to finish before starting another one
-
-		conn->async_read = 0;
-		conn->want &= ~FUSE_CAP_ASYNC_READ;
-		try { g_wrapper->Init(userdata, conn); } catch (const std::exception &ex) { mtp::error("init failed:", ex.what()); }
+		//mtp is completely synchronous, you cannot have two transactions in parallel.
+		//Reads are asynchronous anyway: they are queued while device is busy and merged into larger transactions, see FuseWrapper::QueueRead
+		conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+		try { static_cast<FuseWrapper *>(userdata)->Init(userdata, conn); } catch (const std::exception &ex) { mtp::error("init failed:", ex.what()); }
 	}
 
 	void Lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
-	{ mtp::debug("   Lookup ", parent, " ", name); WRAP_EX(g_wrapper->Lookup(req, FuseId(parent), name)); }
+	{ mtp::debug("   Lookup ", parent, " ", name); TIME_OPERATION(Lookup); WRAP_EX(GetWrapper(req)->Lookup(req, FuseId(parent), name)); }
+
+	void OpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{ mtp::debug("   OpenDir ", ino); TIME_OPERATION(OpenDir); WRAP_EX(GetWrapper(req)->OpenDir(req, FuseId(ino), fi)); }
 
 	void ReadDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
-	{ mtp::debug("   Readdir ", ino, " ", size, " ", off); WRAP_EX(g_wrapper->ReadDir(req, FuseId(ino), size, off, fi)); }
+	{ mtp::debug("   Readdir ", ino, " ", size, " ", off); TIME_OPERATION(ReadDir); WRAP_EX(GetWrapper(req)->ReadDir(req, FuseId(ino), size, off, fi, false)); }
+
+#if FUSE_USE_VERSION >= 30
+	void ReadDirPlus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+	{ mtp::debug("   ReaddirPlus ", ino, " ", size, " ", off); TIME_OPERATION(ReadDir); WRAP_EX(GetWrapper(req)->ReadDir(req, FuseId(ino), size, off, fi, true)); }
+#endif
+
+	void ReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{ mtp::debug("   ReleaseDir ", ino); TIME_OPERATION(ReleaseDir); WRAP_EX(GetWrapper(req)->ReleaseDir(req, FuseId(ino), fi)); }
 
 	void GetAttr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
-	{ mtp::debug("   GetAttr ", ino); WRAP_EX(g_wrapper->GetAttr(req, FuseId(ino), fi)); }
+	{ mtp::debug("   GetAttr ", ino); TIME_OPERATION(GetAttr); WRAP_EX(GetWrapper(req)->GetAttr(req, FuseId(ino), fi)); }
 
 	void SetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
-	{ mtp::debug("   SetAttr ", ino, " 0x", mtp::hex(to_set, 8)); WRAP_EX(g_wrapper->SetAttr(req, FuseId(ino), attr, to_set, fi)); }
+	{ mtp::debug("   SetAttr ", ino, " 0x", mtp::hex(to_set, 8)); TIME_OPERATION(SetAttr); WRAP_EX_NO_RETRY(GetWrapper(req)->SetAttr(req, FuseId(ino), attr, to_set, fi)); }
+
+	void ServeReads(FuseWrapper *wrapper, ReadRequests &reads)
+	{
+		bool reconnect = false;
+		try
+		{ wrapper->Read(reads); return; }
+		catch (const mtp::usb::TimeoutException &ex)
+		{ mtp::error("read timed out, recovering: ", ex.what()); }
+		catch (const mtp::usb::DeviceNotFoundException &)
+		{ mtp::error("read failed, device disconnected"); reconnect = true; }
+		catch (const std::exception &ex)
+		{
+			mtp::error("read failed: ", ex.what());
+			for(auto &r : reads)
+				if (!r.Replied)
+					fuse_reply_err(r.Request, EIO);
+			return;
+		}
+
+		if (RecoverDevice(wrapper, reconnect))
+		{
+			try
+			{ wrapper->Read(reads); return; } //reads are idempotent, replied ones are skipped
+			catch (const std::exception &ex)
+			{ mtp::error("read failed after recovery: ", ex.what()); }
+		}
+		for(auto &r : reads)
+			if (!r.Replied)
+				fuse_reply_err(r.Request, EIO);
+	}
 
 	void Read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
-	{ mtp::debug("   Read ", ino, " ", size, " ", off); WRAP_EX(g_wrapper->Read(req, FuseId(ino), size, off, fi)); }
+	{
+		mtp::debug("   Read ", ino, " ", size, " ", off);
+		FuseWrapper *wrapper = GetWrapper(req);
+		if (!wrapper->QueueRead(req, FuseId(ino), size, off, fi))
+			return; //thread already serving reads replies to this one too
+
+		ReadRequests reads;
+		while(wrapper->NextReads(reads))
+		{
+			ServeReads(wrapper, reads);
+			auto now = std::chrono::steady_clock::now();
+			for(auto &r : reads)
+				wrapper->GetStatistics().Add(fs::Statistics::Read, now - r.Queued);
+		}
+	}
 
 	void Write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
-	{ mtp::debug("   Write ", ino, " ", size, " ", off); WRAP_EX(g_wrapper->Write(req, FuseId(ino), buf, size, off, fi)); }
+	{ mtp::debug("   Write ", ino, " ", size, " ", off); TIME_OPERATION(Write); WRAP_EX_NO_RETRY(GetWrapper(req)->Write(req, FuseId(ino), buf, size, off, fi)); }
 
 	void MakeNode(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
-	{ mtp::debug("   MakeNode ", parent, " ", name, " 0x", mtp::hex(mode, 8)); WRAP_EX(g_wrapper->MakeNode(req, FuseId(parent), name, mode, rdev)); }
+	{ mtp::debug("   MakeNode ", parent, " ", name, " 0x", mtp::hex(mode, 8)); TIME_OPERATION(MakeNode); WRAP_EX_NO_RETRY(GetWrapper(req)->MakeNode(req, FuseId(parent), name, mode, rdev)); }
+
+	void Create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+	{ mtp::debug("   Create ", parent, " ", name, " 0x", mtp::hex(mode, 8)); TIME_OPERATION(Create); WRAP_EX_NO_RETRY(GetWrapper(req)->Create(req, FuseId(parent), name, mode, fi)); }
 
 	void Open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
-	{ mtp::debug("   Open ", ino); WRAP_EX(g_wrapper->Open(req, FuseId(ino), fi)); }
+	{ mtp::debug("   Open ", ino); TIME_OPERATION(Open); WRAP_EX(GetWrapper(req)->Open(req, FuseId(ino), fi)); }
 
+#if FUSE_USE_VERSION >= 30
+	void Rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
+	{ mtp::debug("   Rename ", parent, " ", name, " -> ", newparent, " ", newname, " 0x", mtp::hex(flags, 2)); TIME_OPERATION(Rename); WRAP_EX_NO_RETRY(GetWrapper(req)->Rename(req, FuseId(parent), name, FuseId(newparent), newname, flags)); }
+#else
 	void Rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
-	{ mtp::debug("   Rename ", parent, " ", name, " -> ", newparent, " ", newname); WRAP_EX(g_wrapper->Rename(req, FuseId(parent), name, FuseId(newparent), newname)); }
+	{ mtp::debug("   Rename ", parent, " ", name, " -> ", newparent, " ", newname); TIME_OPERATION(Rename); WRAP_EX_NO_RETRY(GetWrapper(req)->Rename(req, FuseId(parent), name, FuseId(newparent), newname, 0)); }
+#endif
 
 	void Release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
-	{ mtp::debug("   Release ", ino); WRAP_EX(g_wrapper->Release(req, FuseId(ino), fi)); }
+	{ mtp::debug("   Release ", ino); TIME_OPERATION(Release); WRAP_EX(GetWrapper(req)->Release(req, FuseId(ino), fi)); }
+
+	void Flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+	{ mtp::debug("   Flush ", ino); TIME_OPERATION(Flush); WRAP_EX(GetWrapper(req)->Flush(req, FuseId(ino), fi)); }
+
+	void FSync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+	{ mtp::debug("   FSync ", ino, " ", datasync); TIME_OPERATION(FSync); WRAP_EX(GetWrapper(req)->FSync(req, FuseId(ino), datasync, fi)); }
 
 	void MakeDir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
-	{ mtp::debug("   MakeDir ", parent, " ", name, " 0x", mtp::hex(mode, 8)); WRAP_EX(g_wrapper->MakeDir(req, FuseId(parent), name, mode)); }
+	{ mtp::debug("   MakeDir ", parent, " ", name, " 0x", mtp::hex(mode, 8)); TIME_OPERATION(MakeDir); WRAP_EX_NO_RETRY(GetWrapper(req)->MakeDir(req, FuseId(parent), name, mode)); }
 
 	void RemoveDir (fuse_req_t req, fuse_ino_t parent, const char *name)
-	{ mtp::debug("   RemoveDir ", parent, " ", name); WRAP_EX(g_wrapper->RemoveDir(req, FuseId(parent), name)); }
+	{ mtp::debug("   RemoveDir ", parent, " ", name); TIME_OPERATION(RemoveDir); WRAP_EX_NO_RETRY(GetWrapper(req)->RemoveDir(req, FuseId(parent), name)); }
 
 	void Unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
-	{ mtp::debug("   Unlink ", parent, " ", name); WRAP_EX(g_wrapper->Unlink(req, FuseId(parent), name)); }
+	{ mtp::debug("   Unlink ", parent, " ", name); TIME_OPERATION(Unlink); WRAP_EX_NO_RETRY(GetWrapper(req)->Unlink(req, FuseId(parent), name)); }
 
 	void StatFS(fuse_req_t req, fuse_ino_t ino)
-	{ mtp::debug("   StatFS ", ino); WRAP_EX(g_wrapper->StatFS(req, FuseId(ino))); }
+	{ mtp::debug("   StatFS ", ino); TIME_OPERATION(StatFS); WRAP_EX(GetWrapper(req)->StatFS(req, FuseId(ino))); }
+
+	void GetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+	{ mtp::debug("   GetXAttr ", ino, " ", name, " ", size); TIME_OPERATION(GetXAttr); WRAP_EX(GetWrapper(req)->GetXAttr(req, FuseId(ino), name, size)); }
+
+	volatile sig_atomic_t g_exitRequested = 0;
+
+	void RequestExit(int)
+	{ g_exitRequested = 1; }
+
+	void InterruptLoop(int)
+	{ }
+
+	class DeviceMount //! session of one device in multi-device mode, served by its own thread so devices do not wait for each other
+	{
+		std::string				_mountpoint;
+		FuseWrapperPtr			_wrapper;
+		struct fuse_session *	_session;
+#if FUSE_USE_VERSION < 30
+		struct fuse_chan *		_channel;
+#endif
+		std::thread				_thread;
+		std::atomic<bool>		_finished;
+
+	public:
+		DeviceMount(const std::string &mountpoint, const struct fuse_args &args, const struct fuse_lowlevel_ops &ops, const FuseWrapperPtr &wrapper):
+			_mountpoint(mountpoint), _wrapper(wrapper), _session(NULL), _finished(false)
+		{
+			struct fuse_args copy = FUSE_ARGS_INIT(0, NULL); //mount parses and removes options
+			for(int i = 0; i < args.argc; ++i)
+				fuse_opt_add_arg(&copy, args.argv[i]);
+#if FUSE_USE_VERSION >= 30
+			_session = fuse_session_new(&copy, &ops, sizeof(ops), _wrapper.get());
+			fuse_opt_free_args(&copy);
+			if (!_session)
+				throw std::runtime_error("cannot create fuse session for " + mountpoint);
+			if (fuse_session_mount(_session, mountpoint.c_str()) != 0)
+			{
+				fuse_session_destroy(_session);
+				throw std::runtime_error("cannot mount " + mountpoint);
+			}
+			_wrapper->SetNotifyChannel(_session);
+#else
+			_channel = fuse_mount(mountpoint.c_str(), &copy);
+			if (!_channel)
+			{
+				fuse_opt_free_args(&copy);
+				throw std::runtime_error("cannot mount " + mountpoint);
+			}
+			_session = fuse_lowlevel_new(&copy, &ops, sizeof(ops), _wrapper.get());
+			fuse_opt_free_args(&copy);
+			if (!_session)
+			{
+				fuse_unmount(mountpoint.c_str(), _channel);
+				throw std::runtime_error("cannot create fuse session for " + mountpoint);
+			}
+			fuse_session_add_chan(_session, _channel);
+			_wrapper->SetNotifyChannel(_channel);
+#endif
+			_thread = std::thread([this]() { fuse_session_loop(_session); _finished = true; });
+		}
+
+		~DeviceMount()
+		{
+			fuse_session_exit(_session);
+			while(!_finished) //loop checks exit flag after read from kernel is interrupted
+			{
+				pthread_kill(_thread.native_handle(), SIGUSR1);
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+			_thread.join();
+			_wrapper->StopInvalidations();
+#if FUSE_USE_VERSION >= 30
+			fuse_session_unmount(_session);
+			fuse_session_destroy(_session);
+#else
+			fuse_session_remove_chan(_channel);
+			fuse_session_destroy(_session);
+			fuse_unmount(_mountpoint.c_str(), _channel);
+#endif
+			rmdir(_mountpoint.c_str());
+		}
+
+		FuseWrapper & GetWrapper()
+		{ return *_wrapper; }
+
+		const std::string & GetMountpoint() const
+		{ return _mountpoint; }
+	};
+	DECLARE_PTR(DeviceMount);
+
+	///mounts every attached device under root, polling for attached and detached devices until signalled
+	int MountAllDevices(const std::string &root, const struct fuse_args &args, const struct fuse_lowlevel_ops &ops, const MountOptions &options)
+	{
+		struct sigaction sa = { };
+		sa.sa_handler = &InterruptLoop; //no SA_RESTART, interrupts blocking read in session loop
+		sigaction(SIGUSR1, &sa, NULL);
+		sa.sa_handler = &RequestExit;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGHUP, &sa, NULL);
+		signal(SIGPIPE, SIG_IGN);
+
+		static const int PollInterval = 3; //seconds
+		std::map<std::string, DeviceMountPtr> mounts; //by serial
+		auto shareCache = [&mounts, &options]()
+		{
+			unsigned share = options.CacheMemory? std::max<unsigned>(1, options.CacheMemory / std::max<size_t>(1, mounts.size())): 0;
+			for(auto &i : mounts)
+				i.second->GetWrapper().SetCacheMemoryLimit(share);
+		};
+
+		while(!g_exitRequested)
+		{
+			bool changed = false;
+			for(auto i = mounts.begin(); i != mounts.end(); )
+			{
+				if (i->second->GetWrapper().Probe())
+				{
+					++i;
+					continue;
+				}
+				mtp::error("device ", i->first, " detached, unmounting ", i->second->GetMountpoint());
+				i = mounts.erase(i);
+				changed = true;
+			}
+
+			for(auto &device : mtp::Device::FindAll())
+			{
+				std::string serial;
+				try
+				{ serial = device->OpenSession(1)->GetDeviceInfo().SerialNumber; }
+				catch(const std::exception &ex)
+				{ mtp::error("cannot open session: ", ex.what()); continue; }
+				device.reset(); //wrapper claims it again by serial
+
+				if (mounts.find(serial) != mounts.end())
+				{
+					mtp::debug("device ", serial, " is already mounted, devices with the same serial are not supported");
+					continue;
+				}
+
+				std::string name(serial.empty()? "unknown": serial);
+				for(auto &c : name)
+					if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+						c = '_';
+				std::string mountpoint = root + "/" + name;
+				mkdir(mountpoint.c_str(), 0755);
+				try
+				{
+					FuseWrapperPtr wrapper = std::make_shared<FuseWrapper>(options, serial);
+					mounts[serial] = std::make_shared<DeviceMount>(mountpoint, args, ops, wrapper);
+					mtp::error("device ", serial, " mounted at ", mountpoint);
+					changed = true;
+				}
+				catch(const std::exception &ex)
+				{
+					mtp::error("cannot mount device ", serial, ": ", ex.what());
+					rmdir(mountpoint.c_str());
+				}
+			}
+
+			if (changed)
+				shareCache();
+			for(int i = 0; i < PollInterval * 10 && !g_exitRequested; ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		mounts.clear();
+		return 0;
+	}
 }
 
 int main(int argc, char **argv)
@@ -865,48 +3613,135 @@ int main(int argc, char **argv)
 			mtp::g_debug = true;
 	}
 
-	try
-	{ g_wrapper.reset(new FuseWrapper()); }
-	catch(const std::exception &ex)
-	{ mtp::error("connect failed: ", ex.what()); return 1; }
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	MountOptions options;
+	static const struct fuse_opt optionSpecs[] =
+	{
+		{ "aft_cache", offsetof(MountOptions, PersistentCache), 1 },
+		{ "aft_prefetch", offsetof(MountOptions, Prefetch), 1 },
+		{ "aft_cache_memory=%u", offsetof(MountOptions, CacheMemory), 0 },
+		{ "aft_keep_cache", offsetof(MountOptions, KeepCache), 1 },
+		{ "aft_all_devices", offsetof(MountOptions, AllDevices), 1 },
+		FUSE_OPT_END
+	};
+	if (fuse_opt_parse(&args, &options, optionSpecs, NULL) == -1)
+		return 1;
+
+	if (!options.AllDevices)
+	{
+		try
+		{ g_wrapper.reset(new FuseWrapper(options)); }
+		catch(const std::exception &ex)
+		{ mtp::error("connect failed: ", ex.what()); fuse_opt_free_args(&args); return 1; }
+	}
 
 	struct fuse_lowlevel_ops ops = {};
 
 	ops.init		= &Init;
 	ops.lookup		= &Lookup;
+	ops.opendir		= &OpenDir;
 	ops.readdir		= &ReadDir;
+	ops.releasedir	= &ReleaseDir;
+#if FUSE_USE_VERSION >= 30
+	ops.readdirplus	= &ReadDirPlus;
+#endif
 	ops.getattr		= &GetAttr;
 	ops.setattr		= &SetAttr;
 	ops.mknod		= &MakeNode;
+	ops.create		= &Create;
 	ops.open		= &Open;
 	ops.read		= &Read;
 	ops.write		= &Write;
 	ops.mkdir		= &MakeDir;
 	ops.rename		= &Rename;
 	ops.release		= &Release;
+	ops.flush		= &Flush;
+	ops.fsync		= &FSync;
 	ops.rmdir		= &RemoveDir;
 	ops.unlink		= &Unlink;
 	ops.statfs		= &StatFS;
+	ops.getxattr	= &GetXAttr;
 
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int err = -1;
+#if FUSE_USE_VERSION >= 30
+	struct fuse_cmdline_opts cmdline = { };
+	if (fuse_parse_cmdline(&args, &cmdline) == 0)
+	{
+		if (cmdline.show_help)
+		{
+			printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+			fuse_cmdline_help();
+			fuse_lowlevel_help();
+			err = 0;
+		}
+		else if (cmdline.show_version)
+		{
+			fuse_lowlevel_version();
+			err = 0;
+		}
+		else if (!cmdline.mountpoint)
+			mtp::error("no mountpoint specified");
+		else if (options.AllDevices)
+		{
+			if (fuse_daemonize(cmdline.foreground) == -1)
+				perror("fuse_daemonize");
+			err = MountAllDevices(cmdline.mountpoint, args, ops, options);
+		}
+		else
+		{
+			struct fuse_session *se = fuse_session_new(&args, &ops, sizeof(ops), g_wrapper.get());
+			if (se != NULL)
+			{
+				if (fuse_set_signal_handlers(se) == 0)
+				{
+					if (fuse_session_mount(se, cmdline.mountpoint) == 0)
+					{
+						if (fuse_daemonize(cmdline.foreground) == -1)
+							perror("fuse_daemonize");
+						g_wrapper->SetNotifyChannel(se);
+						err = cmdline.singlethread? fuse_session_loop(se): fuse_session_loop_mt(se, cmdline.clone_fd);
+						g_wrapper->StopInvalidations();
+						fuse_session_unmount(se);
+					}
+					fuse_remove_signal_handlers(se);
+				}
+				fuse_session_destroy(se);
+			}
+		}
+		free(cmdline.mountpoint);
+	}
+#else
 	struct fuse_chan *ch;
 	char *mountpoint;
-	int err = -1;
 	int multithreaded = 0, foreground = 0;
 
-	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
-	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
+	int parsed = fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground);
+	if (parsed != -1 && options.AllDevices)
+	{
+		if (!mountpoint)
+			mtp::error("no mountpoint specified");
+		else
+		{
+			if (fuse_daemonize(foreground) == -1)
+				perror("fuse_daemonize");
+			err = MountAllDevices(mountpoint, args, ops, options);
+		}
+		free(mountpoint);
+	}
+	else if (parsed != -1 && (ch = fuse_mount(mountpoint, &args)) != NULL) {
 		struct fuse_session *se;
 
 		se = fuse_lowlevel_new(&args, &ops,
-				       sizeof(ops), NULL);
+				       sizeof(ops), g_wrapper.get());
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1)
 			{
 				fuse_session_add_chan(se, ch);
 				if (fuse_daemonize(foreground) == -1)
 					perror("fuse_daemonize");
+				g_wrapper->SetNotifyChannel(ch);
 				err = (multithreaded? fuse_session_loop_mt: fuse_session_loop)(se);
+				g_wrapper->StopInvalidations();
 				fuse_remove_signal_handlers(se);
 				fuse_session_remove_chan(ch);
 			}
@@ -914,7 +3749,9 @@ int main(int argc, char **argv)
 		}
 		fuse_unmount(mountpoint, ch);
 	}
+#endif
 	fuse_opt_free_args(&args);
+	g_wrapper.reset(); //saves persistent cache
 
 	return err ? 1 : 0;
 }
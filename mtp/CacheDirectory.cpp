@@ -0,0 +1,46 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <mtp/CacheDirectory.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace mtp
+{
+
+	std::string GetCacheDirectory()
+	{
+		std::string dir;
+		const char *cache = getenv("XDG_CACHE_HOME");
+		const char *home = getenv("HOME");
+		if (cache && *cache)
+			dir = cache;
+		else if (home && *home)
+			dir = std::string(home) + "/.cache";
+		else
+			return std::string();
+		mkdir(dir.c_str(), 0700);
+		dir += "/android-file-transfer-linux";
+		mkdir(dir.c_str(), 0700);
+		return dir;
+	}
+
+}
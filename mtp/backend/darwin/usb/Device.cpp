@@ -43,6 +43,15 @@ namespace mtp { namespace usb
 	void Device::SetConfiguration(int idx)
 	{ }
 
+	void Device::ClearHalt(const EndpointPtr & ep)
+	{
+		IOUSBInterfaceInterface	** interface = ep->GetInterfaceHandle();
+		USB_CALL((*interface)->ClearPipeStallBothEnds(interface, ep->GetRefIndex()));
+	}
+
+	void Device::DiscardPendingTransfers()
+	{ } //all transfers are synchronous
+
 	void Device::WriteBulk(const EndpointPtr & ep, const IObjectInputStreamPtr &inputStream, int timeout)
 	{
 		IOUSBInterfaceInterface	** interface = ep->GetInterfaceHandle();
@@ -57,14 +57,34 @@ namespace mtp { namespace usb
 	InterfaceTokenPtr Device::ClaimInterface(const InterfacePtr & interface)
 	{ return std::make_shared<InterfaceToken>(_handle, interface->GetIndex()); }
 
+	void Device::ClearHalt(const EndpointPtr & ep)
+	{ USB_CALL(libusb_clear_halt(_handle, ep->GetAddress())); }
+
+	void Device::DiscardPendingTransfers()
+	{ } //all transfers are synchronous
+
 	void Device::WriteBulk(const EndpointPtr & ep, const IObjectInputStreamPtr &inputStream, int timeout)
 	{
-		ByteArray data(inputStream->GetSize());
-		inputStream->Read(data.data(), data.size());
-		int tr = 0;
-		USB_CALL(libusb_bulk_transfer(_handle, ep->GetAddress(), const_cast<u8 *>(data.data()), data.size(), &tr, timeout));
-		if (tr != (int)data.size())
-			throw std::runtime_error("short write");
+		//stream size may be unknown (streaming uploads report maximum object size), send until stream returns short read
+		size_t packetSize = ep->GetMaxPacketSize();
+		ByteArray data(packetSize * 1024);
+		size_t r;
+		do
+		{
+			r = inputStream->Read(data.data(), data.size());
+			int tr = 0;
+			USB_CALL(libusb_bulk_transfer(_handle, ep->GetAddress(), data.data(), r, &tr, timeout));
+			if (tr != (int)r)
+				throw std::runtime_error("short write");
+		}
+		while(r == data.size());
+
+		//transfer ending on packet boundary is terminated by zero-length packet, empty last chunk has sent it already
+		if (r != 0 && r % packetSize == 0)
+		{
+			int tr = 0;
+			USB_CALL(libusb_bulk_transfer(_handle, ep->GetAddress(), data.data(), 0, &tr, timeout));
+		}
 	}
 
 	void Device::ReadBulk(const EndpointPtr & ep, const IObjectOutputStreamPtr &outputStream, int timeout)
@@ -220,6 +220,39 @@ namespace mtp { namespace usb
 	}
 
 
+	void Device::DiscardPendingTransfers()
+	{
+		static const int ReapTimeout = 100;
+
+		std::map<void *, UrbPtr> urbs;
+		{
+			scoped_mutex_lock l(_mutex);
+			urbs.swap(_urbs);
+		}
+		if (urbs.empty())
+			return;
+
+		debug("discarding ", urbs.size(), " pending urb(s)");
+		for(auto & i : urbs)
+			i.second->Discard();
+
+		//discarded urbs still have to be reaped, keep their buffers alive until then
+		while(!urbs.empty())
+		{
+			void *completedKernelUrb;
+			try { completedKernelUrb = Reap(ReapTimeout); }
+			catch(const TimeoutException &ex) { break; }
+			urbs.erase(completedKernelUrb);
+		}
+
+		if (!urbs.empty())
+		{
+			error(urbs.size(), " discarded urb(s) were not reaped");
+			scoped_mutex_lock l(_mutex);
+			_urbs.insert(urbs.begin(), urbs.end());
+		}
+	}
+
 	void Device::Submit(const UrbPtr &urb, int timeout)
 	{
 		urb->Submit();
@@ -68,6 +68,7 @@ namespace mtp { namespace usb
 		void SetConfiguration(int idx);
 
 		void ClearHalt(const EndpointPtr & ep);
+		void DiscardPendingTransfers();
 		void WriteBulk(const EndpointPtr & ep, const IObjectInputStreamPtr &inputStream, int timeout);
 		void ReadBulk(const EndpointPtr & ep, const IObjectOutputStreamPtr &outputStream, int timeout);
 
@@ -71,68 +71,94 @@ namespace mtp
 		throw std::runtime_error("no interface descriptor found");
 	}
 
-	DevicePtr Device::Find()
+	DevicePtr Device::Open(usb::ContextPtr ctx, usb::DeviceDescriptorPtr desc)
 	{
-		using namespace mtp;
-		usb::ContextPtr ctx(new usb::Context);
+		usb::DevicePtr device = desc->TryOpen(ctx);
+		if (!device)
+			return nullptr;
+		int confs = desc->GetConfigurationsCount();
+		//debug("configurations: ", confs);
 
-		for (usb::DeviceDescriptorPtr desc : ctx->GetDevices())
-		try
+		for(int i = 0; i < confs; ++i)
 		{
-			usb::DevicePtr device = desc->TryOpen(ctx);
-			if (!device)
-				continue;
-			int confs = desc->GetConfigurationsCount();
-			//debug("configurations: ", confs);
-
-			for(int i = 0; i < confs; ++i)
+			usb::ConfigurationPtr conf = desc->GetConfiguration(i);
+			int interfaces = conf->GetInterfaceCount();
+			//debug("interfaces: ", interfaces);
+			for(int j = 0; j < interfaces; ++j)
 			{
-				usb::ConfigurationPtr conf = desc->GetConfiguration(i);
-				int interfaces = conf->GetInterfaceCount();
-				//debug("interfaces: ", interfaces);
-				for(int j = 0; j < interfaces; ++j)
-				{
-					usb::InterfacePtr iface = conf->GetInterface(device, conf, j, 0);
-					usb::InterfaceTokenPtr token = device->ClaimInterface(iface);
-					debug(i, ':', j, ", index: ", iface->GetIndex(), ", enpoints: ", iface->GetEndpointsCount());
+				usb::InterfacePtr iface = conf->GetInterface(device, conf, j, 0);
+				usb::InterfaceTokenPtr token = device->ClaimInterface(iface);
+				debug(i, ':', j, ", index: ", iface->GetIndex(), ", enpoints: ", iface->GetEndpointsCount());
 
 #ifdef USB_BACKEND_LIBUSB
-					std::string name = iface->GetName();
+				std::string name = iface->GetName();
 #else
-					ByteArray data = usb::DeviceRequest(device).GetDescriptor(usb::DescriptorType::String, 0, 0);
-					HexDump("languages", data);
-					if (data.size() < 4 || data[1] != (u8)usb::DescriptorType::String)
-						continue;
-
-					int interfaceStringIndex = GetInterfaceStringIndex(desc, j);
-					u16 langId = data[2] | ((u16)data[3] << 8);
-					data = usb::DeviceRequest(device).GetDescriptor(usb::DescriptorType::String, interfaceStringIndex, langId);
-					HexDump("interface name", data);
-					if (data.size() < 4 || data[1] != (u8)usb::DescriptorType::String)
-						continue;
-
-					u8 len = data[0];
-					InputStream stream(data, 2);
-					std::string name = stream.ReadString((len - 2) / 2);
+				ByteArray data = usb::DeviceRequest(device).GetDescriptor(usb::DescriptorType::String, 0, 0);
+				HexDump("languages", data);
+				if (data.size() < 4 || data[1] != (u8)usb::DescriptorType::String)
+					continue;
+
+				int interfaceStringIndex = GetInterfaceStringIndex(desc, j);
+				u16 langId = data[2] | ((u16)data[3] << 8);
+				data = usb::DeviceRequest(device).GetDescriptor(usb::DescriptorType::String, interfaceStringIndex, langId);
+				HexDump("interface name", data);
+				if (data.size() < 4 || data[1] != (u8)usb::DescriptorType::String)
+					continue;
+
+				u8 len = data[0];
+				InputStream stream(data, 2);
+				std::string name = stream.ReadString((len - 2) / 2);
 #endif
-					if (name == "MTP")
-					{
-						//device->SetConfiguration(configuration->GetIndex());
-						usb::BulkPipePtr pipe = usb::BulkPipe::Create(device, conf, iface, token);
-						return std::make_shared<Device>(pipe);
-					}
-					if (iface->GetClass() == 6 && iface->GetSubclass() == 1)
-					{
-						usb::BulkPipePtr pipe = usb::BulkPipe::Create(device, conf, iface, token);
-						return std::make_shared<Device>(pipe);
-					}
+				if (name == "MTP")
+				{
+					//device->SetConfiguration(configuration->GetIndex());
+					usb::BulkPipePtr pipe = usb::BulkPipe::Create(device, conf, iface, token);
+					return std::make_shared<Device>(pipe);
+				}
+				if (iface->GetClass() == 6 && iface->GetSubclass() == 1)
+				{
+					usb::BulkPipePtr pipe = usb::BulkPipe::Create(device, conf, iface, token);
+					return std::make_shared<Device>(pipe);
 				}
 			}
 		}
+		return nullptr;
+	}
+
+	DevicePtr Device::Find()
+	{
+		using namespace mtp;
+		usb::ContextPtr ctx(new usb::Context);
+
+		for (usb::DeviceDescriptorPtr desc : ctx->GetDevices())
+		try
+		{
+			DevicePtr device = Open(ctx, desc);
+			if (device)
+				return device;
+		}
 		catch(const std::exception &ex)
 		{ error("Device::Find", ex.what()); }
 
 		return nullptr;
 	}
 
+	std::vector<DevicePtr> Device::FindAll()
+	{
+		usb::ContextPtr ctx(new usb::Context);
+		std::vector<DevicePtr> devices;
+
+		for (usb::DeviceDescriptorPtr desc : ctx->GetDevices())
+		try
+		{
+			DevicePtr device = Open(ctx, desc);
+			if (device)
+				devices.push_back(device);
+		}
+		catch(const std::exception &ex)
+		{ debug("Device::FindAll: ", ex.what()); } //devices in use by other sessions fail to claim interface
+
+		return devices;
+	}
+
 }
@@ -24,6 +24,7 @@
 #include <mtp/ptp/PipePacketer.h>
 #include <mtp/ptp/Session.h>
 #include <usb/DeviceDescriptor.h>
+#include <vector>
 
 namespace mtp
 {
@@ -33,13 +34,16 @@ namespace mtp
 
 	private:
 		static int GetInterfaceStringIndex(usb::DeviceDescriptorPtr desc, u8 number);
+		static DevicePtr Open(usb::ContextPtr ctx, usb::DeviceDescriptorPtr desc);
 
 	public:
 		Device(usb::BulkPipePtr pipe);
 
 		SessionPtr OpenSession(u32 sessionId, int timeout = Session::DefaultTimeout);
 
-		static DevicePtr Find(); //fixme: returns first device only
+		static DevicePtr Find(); //returns first device only
+		///returns all devices which could be claimed, skipping ones already used by other sessions
+		static std::vector<DevicePtr> FindAll();
 	};
 }
 
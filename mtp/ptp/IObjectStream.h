@@ -61,12 +61,16 @@ namespace mtp
 	{
 		virtual u64 GetSize() const = 0;
 		virtual size_t Read(u8 *data, size_t size) = 0;
+		///positions stream at absolute offset, returns false if stream can only be read sequentially
+		virtual bool Seek(u64 /*offset*/) { return false; }
 	};
 	DECLARE_PTR(IObjectInputStream);
 
 	struct IObjectOutputStream : public virtual ICancellableStream //! Basic output stream interface
 	{
 		virtual size_t Write(const u8 *data, size_t size) = 0;
+		///flushes written data to stable storage, no-op for memory streams
+		virtual void Sync() { }
 	};
 	DECLARE_PTR(IObjectOutputStream);
 
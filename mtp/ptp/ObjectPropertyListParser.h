@@ -68,6 +68,21 @@ namespace mtp
 			}
 
 		};
+
+		template<>
+		struct ObjectPropertyParser<ByteArray>
+		{
+			static ByteArray Parse(InputStream &stream, DataTypeCode dataType)
+			{
+				if (dataType != DataTypeCode::Uint128 && dataType != DataTypeCode::Int128)
+					throw std::runtime_error("got invalid type");
+
+				ByteArray value(16);
+				for(auto &b : value)
+					b = stream.Read8();
+				return value;
+			}
+		};
 	}
 
 	template<typename PropertyValueType, template <typename> class Parser = impl::ObjectPropertyParser>
@@ -26,8 +26,11 @@
 #include <mtp/ptp/OperationRequest.h>
 #include <mtp/usb/Request.h>
 #include <usb/Device.h>
+#include <mtp/usb/TimeoutException.h>
 #include <mtp/log.h>
 
+#include <thread>
+#include <chrono>
 
 namespace mtp
 {
@@ -239,5 +242,89 @@ namespace mtp
 			0, 0, req.Data, timeout);
 	}
 
+	ResponseType PipePacketer::GetDeviceStatus(int timeout)
+	{
+		ByteArray data(64);
+		/* 0xa1: device-to-host, class specific, recipient - interface, 0x67: get device status */
+		_pipe->GetDevice()->ReadControl(
+			(u8)(usb::RequestType::DeviceToHost | usb::RequestType::Class | usb::RequestType::Interface),
+			0x67,
+			0, 0, data, timeout);
+		HexDump("device status", data);
+		if (data.size() < 4)
+			throw std::runtime_error("short device status reply");
+
+		InputStream stream(data);
+		u16 length;
+		ResponseType code;
+		stream >> length;
+		stream >> code;
+		return code;
+	}
+
+	void PipePacketer::ResetDevice(int timeout)
+	{
+		/* 0x21: host-to-device, class specific, recipient - interface, 0x66: device reset request */
+		_pipe->GetDevice()->WriteControl(
+			(u8)(usb::RequestType::HostToDevice | usb::RequestType::Class | usb::RequestType::Interface),
+			0x66,
+			0, 0, ByteArray(), timeout);
+	}
+
+	void PipePacketer::Recover(u32 transaction, int timeout)
+	{
+		static const int StatusPollCount	= 10;
+		static const int StatusPollInterval	= 100;
+		static const int DrainTimeout		= 200;
+
+		_pipe->Recover();
+
+		auto waitForDevice = [this, timeout]() -> bool
+		{
+			for(int i = 0; i < StatusPollCount; ++i)
+			{
+				ResponseType status = GetDeviceStatus(timeout);
+				debug("device status: ", hex(status, 4));
+				if (status == ResponseType::OK)
+					return true;
+				if (status != ResponseType::DeviceBusy)
+					_pipe->Recover(); //transaction cancelled or endpoints stalled
+				std::this_thread::sleep_for(std::chrono::milliseconds(StatusPollInterval));
+			}
+			return false;
+		};
+
+		if (!waitForDevice())
+		{
+			error("device is not ready, cancelling transaction ", transaction);
+			OperationRequest req(OperationCode::CancelTransaction, transaction);
+			_pipe->GetDevice()->WriteControl(
+				(u8)(usb::RequestType::HostToDevice | usb::RequestType::Class | usb::RequestType::Interface),
+				0x64,
+				0, 0, req.Data, timeout);
+
+			if (!waitForDevice())
+			{
+				error("device is not ready after cancel, resetting device");
+				ResetDevice(timeout);
+				if (!waitForDevice())
+					throw std::runtime_error("device did not recover after reset");
+			}
+		}
+
+		//drop any stale data left in the bulk-in pipe by the failed transaction
+		try
+		{
+			for(int i = 0; i < StatusPollCount; ++i)
+			{
+				ByteArrayObjectOutputStreamPtr stream(new ByteArrayObjectOutputStream);
+				_pipe->Read(stream, DrainTimeout);
+				HexDump("dropped stale data", stream->GetData());
+			}
+		}
+		catch(const usb::TimeoutException &ex)
+		{ }
+		_pipe->GetDevice()->DiscardPendingTransfers();
+	}
 
 }
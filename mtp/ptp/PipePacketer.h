@@ -48,6 +48,10 @@ namespace mtp
 		void PollEvent();
 		void Abort(u32 transaction, int timeout);
 
+		ResponseType GetDeviceStatus(int timeout);
+		void ResetDevice(int timeout);
+		void Recover(u32 transaction, int timeout);
+
 	private:
 		void ReadMessage(const IObjectOutputStreamPtr &outputStream, int timeout);
 	};
@@ -23,7 +23,9 @@
 #include <mtp/ptp/OperationRequest.h>
 #include <mtp/ptp/ByteArrayObjectStream.h>
 #include <mtp/ptp/JoinedObjectStream.h>
+#include <mtp/log.h>
 #include <usb/Device.h>
+#include <algorithm>
 #include <limits>
 #include <array>
 
@@ -42,6 +44,8 @@ namespace mtp
 } while(false)
 
 	Session::Session(usb::BulkPipePtr pipe, u32 sessionId):
+		_pendingTransactions(0), _grantedTransactions(0),
+		_transferChunkSize(DefaultTransferChunkSize), _transferFairness(DefaultTransferFairness),
 		_packeter(pipe), _sessionId(sessionId), _nextTransactionId(1), _transaction(), _defaultTimeout(DefaultTimeout)
 	{
 		_deviceInfo = GetDeviceInfoImpl();
@@ -77,6 +81,47 @@ namespace mtp
 	}
 
 
+	scoped_mutex_lock Session::Lock()
+	{
+		{
+			scoped_mutex_lock l(_schedulerMutex);
+			++_pendingTransactions;
+		}
+		scoped_mutex_lock l(_mutex);
+		{
+			scoped_mutex_lock s(_schedulerMutex);
+			--_pendingTransactions;
+			++_grantedTransactions;
+		}
+		_schedulerCondition.notify_all();
+		return l;
+	}
+
+	scoped_mutex_lock Session::LockBackground()
+	{
+		{
+			//let up to _transferFairness pending transactions run before the next chunk
+			scoped_mutex_lock l(_schedulerMutex);
+			u64 granted = _grantedTransactions;
+			_schedulerCondition.wait(l, [this, granted]() { return _pendingTransactions == 0 || _grantedTransactions - granted >= _transferFairness; });
+		}
+		return scoped_mutex_lock(_mutex);
+	}
+
+	void Session::SetTransferChunkSize(u32 size)
+	{
+		if (size == 0)
+			throw std::runtime_error("transfer chunk size must not be zero");
+		scoped_mutex_lock l(_schedulerMutex);
+		_transferChunkSize = size;
+	}
+
+	void Session::SetTransferFairness(unsigned transactions)
+	{
+		scoped_mutex_lock l(_schedulerMutex);
+		_transferFairness = transactions;
+	}
+
 	void Session::Send(const OperationRequest &req, int timeout)
 	{
 		if (timeout <= 0)
@@ -87,7 +132,7 @@ namespace mtp
 
 	void Session::Close()
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Send(OperationRequest(OperationCode::CloseSession, 0, _sessionId));
 		ByteArray data, response;
 		ResponseType responseCode;
@@ -108,7 +153,7 @@ namespace mtp
 
 	msg::DeviceInfo Session::GetDeviceInfoImpl()
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetDeviceInfo, transaction.Id));
 		ByteArray data = Get(transaction.Id);
@@ -121,7 +166,7 @@ namespace mtp
 
 	msg::ObjectHandles Session::GetObjectHandles(StorageId storageId, ObjectFormat objectFormat, ObjectId parent, int timeout)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetObjectHandles, transaction.Id, storageId.Id, static_cast<u32>(objectFormat), parent.Id), timeout);
 		ByteArray data = Get(transaction.Id, timeout);
@@ -134,7 +179,7 @@ namespace mtp
 
 	msg::StorageIDs Session::GetStorageIDs()
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetStorageIDs, transaction.Id));
 		ByteArray data = Get(transaction.Id);
@@ -147,7 +192,7 @@ namespace mtp
 
 	msg::StorageInfo Session::GetStorageInfo(StorageId storageId)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetStorageInfo, transaction.Id, storageId.Id));
 		ByteArray data = Get(transaction.Id);
@@ -173,7 +218,7 @@ namespace mtp
 
 	msg::ObjectInfo Session::GetObjectInfo(ObjectId objectId)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetObjectInfo, transaction.Id, objectId.Id));
 		ByteArray data = Get(transaction.Id);
@@ -183,9 +228,17 @@ namespace mtp
 		return goi;
 	}
 
+	ByteArray Session::GetThumb(ObjectId objectId)
+	{
+		scoped_mutex_lock l(Lock());
+		Transaction transaction(this);
+		Send(OperationRequest(OperationCode::GetThumb, transaction.Id, objectId.Id));
+		return Get(transaction.Id);
+	}
+
 	msg::ObjectPropertiesSupported Session::GetObjectPropertiesSupported(ObjectId objectId)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetObjectPropsSupported, transaction.Id, objectId.Id));
 		ByteArray data = Get(transaction.Id);
@@ -197,7 +250,7 @@ namespace mtp
 
 	void Session::GetObject(ObjectId objectId, const IObjectOutputStreamPtr &outputStream)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetObject, transaction.Id, objectId.Id));
 		ByteArray response;
@@ -208,7 +261,69 @@ namespace mtp
 
 	ByteArray Session::GetPartialObject(ObjectId objectId, u64 offset, u32 size)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
+		return GetPartialObjectImpl(objectId, offset, size);
+	}
+
+	namespace
+	{
+		class CountingObjectOutputStream : public IObjectOutputStream, public CancellableStream //! passes data to another stream counting written bytes
+		{
+			IObjectOutputStreamPtr	_stream;
+			u64						_size;
+
+		public:
+			CountingObjectOutputStream(const IObjectOutputStreamPtr &stream): _stream(stream), _size(0) { }
+
+			u64 GetSize() const
+			{ return _size; }
+
+			virtual size_t Write(const u8 *data, size_t size)
+			{
+				CheckCancelled();
+				size_t r = _stream->Write(data, size);
+				_size += r;
+				return r;
+			}
+		};
+		DECLARE_PTR(CountingObjectOutputStream);
+	}
+
+	void Session::GetPartialObject(ObjectId objectId, u64 offset, u64 size, const IObjectOutputStreamPtr &outputStream, const std::function<void (u64)> &checkpoint)
+	{
+		u32 transferChunkSize;
+		{
+			scoped_mutex_lock l(_schedulerMutex);
+			transferChunkSize = _transferChunkSize;
+		}
+		while(size > 0)
+		{
+			u32 chunkSize = std::min<u64>(size, transferChunkSize);
+			CountingObjectOutputStreamPtr chunk(new CountingObjectOutputStream(outputStream));
+			{
+				scoped_mutex_lock l(LockBackground());
+				GetPartialObjectImpl(objectId, offset, chunkSize, chunk);
+			}
+			u64 received = chunk->GetSize();
+			if (received == 0 || received > chunkSize)
+				throw std::runtime_error("GetPartialObject returned invalid amount of data");
+
+			offset += received;
+			size -= received;
+			if (checkpoint)
+				checkpoint(offset);
+		}
+	}
+
+	ByteArray Session::GetPartialObjectImpl(ObjectId objectId, u64 offset, u32 size)
+	{
+		ByteArrayObjectOutputStreamPtr stream(new ByteArrayObjectOutputStream);
+		GetPartialObjectImpl(objectId, offset, size, stream);
+		return stream->GetData();
+	}
+
+	void Session::GetPartialObjectImpl(ObjectId objectId, u64 offset, u32 size, const IObjectOutputStreamPtr &outputStream)
+	{
 		Transaction transaction(this);
 		if (_getPartialObject64Supported)
 			Send(OperationRequest(OperationCode::GetPartialObject64, transaction.Id, objectId.Id, offset, offset >> 32, size));
@@ -218,7 +333,10 @@ namespace mtp
 				throw std::runtime_error("32 bit overflow for GetPartialObject");
 			Send(OperationRequest(OperationCode::GetPartialObject, transaction.Id, objectId.Id, offset, size));
 		}
-		return Get(transaction.Id);
+		ByteArray response;
+		ResponseType responseCode;
+		_packeter.Read(transaction.Id, outputStream, responseCode, response, _defaultTimeout);
+		CHECK_RESPONSE(responseCode);
 	}
 
 
@@ -226,7 +344,7 @@ namespace mtp
 	{
 		if (objectInfo.Filename.empty())
 			throw std::runtime_error("object filename must not be empty");
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::SendObjectInfo, transaction.Id, storageId.Id, parentObject.Id));
 		{
@@ -251,7 +369,7 @@ namespace mtp
 
 	void Session::SendObject(const IObjectInputStreamPtr &inputStream, int timeout)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::SendObject, transaction.Id));
 		{
@@ -264,7 +382,7 @@ namespace mtp
 
 	void Session::BeginEditObject(ObjectId objectId)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::BeginEditObject, transaction.Id, objectId.Id));
 		Get(transaction.Id);
@@ -272,7 +390,12 @@ namespace mtp
 
 	void Session::SendPartialObject(ObjectId objectId, u64 offset, const ByteArray &data)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
+		SendPartialObjectImpl(objectId, offset, data);
+	}
+
+	void Session::SendPartialObjectImpl(ObjectId objectId, u64 offset, const ByteArray &data)
+	{
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::SendPartialObject, transaction.Id, objectId.Id, offset, offset >> 32, data.size()));
 		{
@@ -286,7 +409,7 @@ namespace mtp
 
 	void Session::TruncateObject(ObjectId objectId, u64 size)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		//64 bit size?
 		Send(OperationRequest(OperationCode::TruncateObject, transaction.Id, objectId.Id, size, size >> 32));
@@ -295,7 +418,7 @@ namespace mtp
 
 	void Session::EndEditObject(ObjectId objectId)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::EndEditObject, transaction.Id, objectId.Id));
 		Get(transaction.Id);
@@ -303,7 +426,7 @@ namespace mtp
 
 	void Session::SetObjectProperty(ObjectId objectId, ObjectProperty property, const ByteArray &value)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::SetObjectPropValue, transaction.Id, objectId.Id, (u16)property));
 		{
@@ -337,7 +460,7 @@ namespace mtp
 
 	ByteArray Session::GetObjectProperty(ObjectId objectId, ObjectProperty property)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetObjectPropValue, transaction.Id, objectId.Id, (u16)property));
 		return Get(transaction.Id);
@@ -388,7 +511,7 @@ namespace mtp
 	{
 		if (objectId == Root) //ffffffff -> 0
 			objectId = Device;
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetObjectPropList, transaction.Id, objectId.Id, (u32)format, property != ObjectProperty::All? (u32)property: 0xffffffffu, groupCode, depth), timeout);
 		return Get(transaction.Id, timeout);
@@ -396,15 +519,25 @@ namespace mtp
 
 	void Session::DeleteObject(ObjectId objectId)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::DeleteObject, transaction.Id, objectId.Id, 0));
 		Get(transaction.Id);
 	}
 
+	void Session::MoveObject(ObjectId objectId, StorageId storageId, ObjectId parentObject)
+	{
+		if (parentObject == Root)
+			parentObject = Device; //unlike SendObjectInfo, MoveObject denotes storage root with 0
+		scoped_mutex_lock l(Lock());
+		Transaction transaction(this);
+		Send(OperationRequest(OperationCode::MoveObject, transaction.Id, objectId.Id, storageId.Id, parentObject.Id));
+		Get(transaction.Id);
+	}
+
 	ByteArray Session::GetDeviceProperty(DeviceProperty property)
 	{
-		scoped_mutex_lock l(_mutex);
+		scoped_mutex_lock l(Lock());
 		Transaction transaction(this);
 		Send(OperationRequest(OperationCode::GetDevicePropValue, transaction.Id, (u16)property));
 		return Get(transaction.Id);
@@ -417,7 +550,86 @@ namespace mtp
 
 	Session::ObjectEditSession::~ObjectEditSession()
 	{
-		_session->EndEditObject(_objectId);
+		try { _session->EndEditObject(_objectId); }
+		catch(const std::exception &ex) { error("EndEditObject failed: ", ex.what()); }
+	}
+
+	namespace
+	{
+		bool ReadExactly(const IObjectInputStreamPtr &stream, u8 *data, size_t size)
+		{
+			while(size)
+			{
+				size_t r = stream->Read(data, size);
+				if (r == 0)
+					return false;
+				data += r;
+				size -= r;
+			}
+			return true;
+		}
+
+		///advances stream from position by size bytes, seeking if stream supports it
+		bool Skip(const IObjectInputStreamPtr &stream, u64 position, u64 size, ByteArray &buffer)
+		{
+			if (size && stream->Seek(position + size))
+				return true;
+			while(size)
+			{
+				size_t n = std::min<u64>(size, buffer.size());
+				if (!ReadExactly(stream, buffer.data(), n))
+					return false;
+				size -= n;
+			}
+			return true;
+		}
+	}
+
+	bool Session::UpdateObject(const SessionPtr &session, ObjectId objectId, const IObjectInputStreamPtr &inputStream)
+	{
+		static const u32 SampleSize = 64 * 1024;
+		static const u64 Samples = 8;
+
+		if (!session->EditObjectSupported())
+			return false;
+
+		u64 size = inputStream->GetSize();
+		u64 remoteSize = session->GetObjectIntegerProperty(objectId, ObjectProperty::ObjectSize);
+		if (remoteSize > size)
+			return false;
+
+		//sample blocks evenly, always including the first and the last block of remote object
+		u32 sampleSize = std::min<u64>(SampleSize, remoteSize);
+		u64 span = remoteSize - sampleSize;
+		ByteArray local(SampleSize);
+		u64 position = 0;
+		for(u64 i = 0; sampleSize && i < Samples; ++i)
+		{
+			u64 offset = span * i / (Samples - 1);
+			if (offset < position)
+				continue;
+
+			if (!Skip(inputStream, position, offset - position, local) || !ReadExactly(inputStream, local.data(), sampleSize))
+				return false;
+			position = offset + sampleSize;
+
+			ByteArray remote = session->GetPartialObject(objectId, offset, sampleSize);
+			if (remote.size() != sampleSize || !std::equal(remote.begin(), remote.end(), local.begin()))
+			{
+				debug("object ", objectId.Id, " differs from local data at ", offset);
+				return false;
+			}
+		}
+
+		if (!Skip(inputStream, position, remoteSize - position, local))
+			return false;
+		if (remoteSize == size)
+			return true;
+
+		ObjectEditSession edit(session, objectId);
+		edit.Send(remoteSize, inputStream);
+		edit.Truncate(size);
+		return true;
 	}
 
 	void Session::ObjectEditSession::Truncate(u64 size)
@@ -430,6 +642,40 @@ namespace mtp
 		_session->SendPartialObject(_objectId, offset, data);
 	}
 
+	void Session::ObjectEditSession::Send(u64 offset, const IObjectInputStreamPtr &inputStream, const std::function<void (u64)> &checkpoint)
+	{
+		u32 chunkSize;
+		{
+			scoped_mutex_lock l(_session->_schedulerMutex);
+			chunkSize = _session->_transferChunkSize;
+		}
+
+		ByteArray data(chunkSize);
+		while(true)
+		{
+			size_t size = 0;
+			while(size < data.size())
+			{
+				size_t r = inputStream->Read(data.data() + size, data.size() - size);
+				if (r == 0)
+					break;
+				size += r;
+			}
+			if (size == 0)
+				break;
+
+			{
+				scoped_mutex_lock l(_session->LockBackground());
+				_session->SendPartialObjectImpl(_objectId, offset, size == data.size()? data: ByteArray(data.begin(), data.begin() + size));
+			}
+			offset += size;
+			if (checkpoint)
+				checkpoint(offset);
+			if (size < data.size())
+				break;
+		}
+	}
+
 	void Session::AbortCurrentTransaction(int timeout)
 	{
 		u32 transactionId;
@@ -442,4 +688,35 @@ namespace mtp
 		_packeter.Abort(transactionId, timeout);
 	}
 
+	void Session::Recover(int timeout)
+	{
+		scoped_mutex_lock l(Lock());
+		u32 transactionId;
+		{
+			scoped_mutex_lock t(_transactionMutex);
+			transactionId = _nextTransactionId - 1;
+		}
+		_packeter.Recover(transactionId, timeout);
+
+		//device reset request could close current session, reopen it with the same id, so object handles remain valid
+		ByteArray data, response;
+		ResponseType responseCode;
+		{
+			Transaction transaction(this);
+			Send(OperationRequest(OperationCode::GetStorageIDs, transaction.Id), timeout);
+			_packeter.Read(0, data, responseCode, response, timeout);
+		}
+		if (responseCode == ResponseType::SessionNotOpen)
+		{
+			debug("session ", _sessionId, " was closed, reopening");
+			Send(OperationRequest(OperationCode::OpenSession, 0, _sessionId), timeout);
+			_packeter.Read(0, data, responseCode, response, timeout);
+			CHECK_RESPONSE(responseCode);
+			scoped_mutex_lock t(_transactionMutex);
+			_nextTransactionId = 1;
+		}
+		else
+			CHECK_RESPONSE(responseCode);
+	}
+
 }
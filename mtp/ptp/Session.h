@@ -27,6 +27,8 @@
 #include <mtp/ptp/ObjectId.h>
 #include <mtp/ptp/ObjectProperty.h>
 #include <mtp/ptp/PipePacketer.h>
+#include <condition_variable>
+#include <functional>
 
 namespace mtp
 {
@@ -40,6 +42,12 @@ namespace mtp
 		class Transaction;
 
 		std::mutex		_mutex, _transactionMutex;
+		std::mutex		_schedulerMutex;
+		std::condition_variable _schedulerCondition;
+		unsigned		_pendingTransactions;
+		u64				_grantedTransactions;
+		u32				_transferChunkSize;
+		unsigned		_transferFairness;
 		PipePacketer	_packeter;
 		u32				_sessionId;
 		u32				_nextTransactionId;
@@ -55,6 +63,9 @@ namespace mtp
 		static const int DefaultTimeout		= 10000;
 		static const int LongTimeout		= 30000;
 
+		static const u32 DefaultTransferChunkSize		= 4 * 1024 * 1024;
+		static const unsigned DefaultTransferFairness	= 4;
+
 		static const StorageId AllStorages;
 		static const StorageId AnyStorage;
 		static const ObjectId Device;
@@ -79,6 +90,9 @@ namespace mtp
 
 			void Truncate(u64 size);
 			void Send(u64 offset, const ByteArray &data);
+			///sends stream contents starting from offset, splitting it into scheduled SendPartialObject chunks
+			///checkpoint receives new offset after each chunk accepted by device
+			void Send(u64 offset, const IObjectInputStreamPtr &inputStream, const std::function<void (u64)> &checkpoint = std::function<void (u64)>());
 		};
 		DECLARE_PTR(ObjectEditSession);
 
@@ -94,20 +108,38 @@ namespace mtp
 
 		NewObjectInfo CreateDirectory(const std::string &name, ObjectId parentId, StorageId storageId = AnyStorage, AssociationType type = AssociationType::GenericFolder);
 		msg::ObjectInfo GetObjectInfo(ObjectId objectId);
+		///returns device-generated thumbnail in format reported by ObjectInfo, throws InvalidResponseException with NoThumbnailPresent if there is none
+		ByteArray GetThumb(ObjectId objectId);
 		void GetObject(ObjectId objectId, const IObjectOutputStreamPtr &outputStream);
 		ByteArray GetPartialObject(ObjectId objectId, u64 offset, u32 size);
+		///reads object range in GetPartialObject chunks, letting pending transactions run between chunks
+		///checkpoint is called with offset reached after every chunk
+		void GetPartialObject(ObjectId objectId, u64 offset, u64 size, const IObjectOutputStreamPtr &outputStream, const std::function<void (u64)> &checkpoint = std::function<void (u64)>());
 		NewObjectInfo SendObjectInfo(const msg::ObjectInfo &objectInfo, StorageId storageId = AnyStorage, ObjectId parentObject = Device);
 		void SendObject(const IObjectInputStreamPtr &inputStream, int timeout = LongTimeout);
 		void DeleteObject(ObjectId objectId);
+		///moves object keeping its handle, pass Root as parent to move it to the top level of storage
+		void MoveObject(ObjectId objectId, StorageId storageId, ObjectId parentObject);
 
 		bool EditObjectSupported() const
 		{ return _editObjectSupported; }
 		bool GetObjectPropertyListSupported() const
 		{ return _getObjectPropertyListSupported; }
+		bool GetPartialObject64Supported() const
+		{ return _getPartialObject64Supported; }
+
+		///sets size of the chunks used by scheduled (background) transfers
+		void SetTransferChunkSize(u32 size);
+		///sets maximum number of transactions allowed to run between two chunks of scheduled transfer, 0 disables scheduling
+		void SetTransferFairness(unsigned transactions);
 
 		static ObjectEditSessionPtr EditObject(const SessionPtr &session, ObjectId objectId)
 		{ return std::make_shared<ObjectEditSession>(session, objectId); }
 
+		///sends only the tail of inputStream if remote object is its shorter prefix (checked by sampling blocks)
+		///returns false leaving object intact if it can't be updated this way, inputStream is partially consumed then
+		static bool UpdateObject(const SessionPtr &session, ObjectId objectId, const IObjectInputStreamPtr &inputStream);
+
 		msg::ObjectPropertiesSupported GetObjectPropertiesSupported(ObjectId objectId);
 
 		void SetObjectProperty(ObjectId objectId, ObjectProperty property, const ByteArray &value);
@@ -127,14 +159,22 @@ namespace mtp
 		ByteArray GetDeviceProperty(DeviceProperty property);
 
 		void AbortCurrentTransaction(int timeout);
+		///resynchronises device after transport failure (e.g. timeout), keeping session and object handles
+		void Recover(int timeout = DefaultTimeout);
 
 	private:
 		void SetCurrentTransaction(Transaction *);
 
+		scoped_mutex_lock Lock();
+		scoped_mutex_lock LockBackground();
+
 		msg::DeviceInfo GetDeviceInfoImpl();
 
 		void BeginEditObject(ObjectId objectId);
 		void SendPartialObject(ObjectId objectId, u64 offset, const ByteArray &data);
+		ByteArray GetPartialObjectImpl(ObjectId objectId, u64 offset, u32 size);
+		void GetPartialObjectImpl(ObjectId objectId, u64 offset, u32 size, const IObjectOutputStreamPtr &outputStream);
+		void SendPartialObjectImpl(ObjectId objectId, u64 offset, const ByteArray &data);
 		void TruncateObject(ObjectId objectId, u64 size);
 		void EndEditObject(ObjectId objectId);
 
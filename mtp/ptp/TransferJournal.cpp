@@ -0,0 +1,188 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <mtp/ptp/TransferJournal.h>
+#include <mtp/ptp/Session.h>
+#include <mtp/ptp/Messages.h>
+#include <mtp/ptp/Response.h>
+#include <mtp/CacheDirectory.h>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace mtp
+{
+
+	namespace
+	{
+		const char * JournalSignature = "aft-journal 1";
+	}
+
+	bool TransferJournal::Record::SameObject(const Record &other) const
+	{
+		return Size == other.Size &&
+			ModificationDate == other.ModificationDate && PersistentId == other.PersistentId;
+	}
+
+	bool TransferJournal::Load(Record &record) const
+	{
+		std::ifstream file(_path.c_str());
+		std::string line;
+		if (!std::getline(file, line) || line != JournalSignature)
+			return false;
+
+		Record r;
+		unsigned fields = 0, optional = 0;
+		while(std::getline(file, line))
+		{
+			size_t sep = line.find(' ');
+			if (sep == line.npos)
+				return false;
+			std::string key = line.substr(0, sep), value = line.substr(sep + 1);
+			std::istringstream ss(value);
+			if (key == "object")
+				ss >> r.ObjectId.Id;
+			else if (key == "size")
+				ss >> r.Size;
+			else if (key == "mtime")
+				r.ModificationDate = value;
+			else if (key == "puid")
+			{
+				if (value.size() % 2)
+					return false;
+				for(size_t i = 0; i < value.size(); i += 2)
+					r.PersistentId.push_back(static_cast<u8>(std::stoul(value.substr(i, 2), nullptr, 16)));
+			}
+			else if (key == "offset")
+				ss >> r.Offset;
+			else if (key == "parent") //optional, written for uploads only
+			{ ss >> r.Parent.Id; ++optional; }
+			else if (key == "storage")
+			{ ss >> r.Storage.Id; ++optional; }
+			else
+				continue;
+
+			if (ss.fail())
+				return false;
+			++fields;
+		}
+		if (fields - optional != 5 || r.Offset > r.Size)
+			return false;
+
+		record = r;
+		return true;
+	}
+
+	void TransferJournal::Save(const Record &record) const
+	{
+		std::ostringstream text;
+		text << JournalSignature << "\n";
+		text << "object " << record.ObjectId.Id << "\n";
+		text << "size " << record.Size << "\n";
+		text << "mtime " << record.ModificationDate << "\n";
+		text << "puid ";
+		for(u8 byte : record.PersistentId)
+			text << std::hex << std::setw(2) << std::setfill('0') << static_cast<unsigned>(byte);
+		text << std::dec << "\n";
+		text << "offset " << record.Offset << "\n";
+		if (record.Parent != mtp::ObjectId() || record.Storage != mtp::StorageId())
+		{
+			text << "parent " << record.Parent.Id << "\n";
+			text << "storage " << record.Storage.Id << "\n";
+		}
+		std::string data = text.str();
+
+		//data has to reach the disk before rename, or journal could be found empty after crash
+		std::string tmp = _path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("cannot create transfer journal " + tmp);
+		bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && fsync(fd) == 0;
+		close(fd);
+		if (!ok)
+			throw std::runtime_error("cannot write transfer journal " + tmp);
+		if (rename(tmp.c_str(), _path.c_str()) != 0)
+			throw std::runtime_error("cannot replace transfer journal " + _path);
+	}
+
+	std::string TransferJournal::GetUploadPath(const std::string &filename)
+	{
+		std::string path = filename;
+		char *resolved = realpath(filename.c_str(), NULL);
+		if (resolved)
+		{
+			path = resolved;
+			free(resolved);
+		}
+
+		std::string name = path.substr(path.rfind('/') + 1);
+		for(auto &c : name)
+			if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-')
+				c = '_';
+		std::ostringstream ss;
+		ss << std::hex << std::setw(16) << std::setfill('0') << static_cast<u64>(std::hash<std::string>()(path)) << '-' << name << ".aft-upload-journal";
+
+		std::string dir = GetCacheDirectory();
+		return dir.empty()? ss.str(): dir + "/" + ss.str();
+	}
+
+	void TransferJournal::Remove() const
+	{ remove(_path.c_str()); }
+
+	TransferJournal::Record TransferJournal::GetObjectRecord(Session &session, mtp::ObjectId objectId)
+	{
+		Record record;
+		record.ObjectId = objectId;
+
+		msg::ObjectInfo info = session.GetObjectInfo(objectId);
+		record.ModificationDate = info.ModificationDate;
+		try
+		{ record.Size = session.GetObjectIntegerProperty(objectId, ObjectProperty::ObjectSize); }
+		catch(const InvalidResponseException &)
+		{ record.Size = info.ObjectCompressedSize; }
+
+		try
+		{ record.PersistentId = session.GetObjectProperty(objectId, ObjectProperty::PersistentUniqueObjectId); }
+		catch(const InvalidResponseException &)
+		{ }
+		return record;
+	}
+
+	TransferJournal::Record TransferJournal::GetFileRecord(const std::string &path)
+	{
+		struct stat st = {};
+		if (stat(path.c_str(), &st) != 0)
+			throw std::runtime_error("stat failed: " + path);
+
+		Record record;
+		record.Size = st.st_size;
+		record.ModificationDate = std::to_string(static_cast<long long>(st.st_mtime));
+		return record;
+	}
+
+}
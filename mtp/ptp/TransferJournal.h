@@ -0,0 +1,82 @@
+/*
+    This file is part of Android File Transfer For Linux.
+    Copyright (C) 2015-2016  Vladimir Menshakov
+
+    Android File Transfer For Linux is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    Android File Transfer For Linux is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Android File Transfer For Linux.
+    If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AFTL_MTP_PTP_TRANSFERJOURNAL_H
+#define AFTL_MTP_PTP_TRANSFERJOURNAL_H
+
+#include <mtp/ptp/IObjectStream.h>
+#include <mtp/ptp/ObjectId.h>
+#include <mtp/ByteArray.h>
+#include <string>
+
+namespace mtp
+{
+	class Session;
+	DECLARE_PTR(Session);
+
+	class TransferJournal //! sidecar file recording progress of interrupted transfer
+	{
+	public:
+		struct Record //! object identity and number of bytes already transferred
+		{
+			mtp::ObjectId	ObjectId;
+			u64				Size;
+			std::string		ModificationDate;
+			ByteArray		PersistentId;
+			u64				Offset;
+			mtp::ObjectId	Parent;		//!< requested parent of uploaded object
+			mtp::StorageId	Storage;	//!< storage of uploaded object
+
+			Record(): Size(0), Offset(0) { }
+
+			///returns true if both records describe the same unchanged object, ObjectId is not compared as it may change between sessions
+			bool SameObject(const Record &other) const;
+		};
+
+	private:
+		std::string		_path;
+
+	public:
+		TransferJournal(const std::string &path): _path(path) { }
+
+		static std::string GetPath(const std::string &filename)
+		{ return filename + ".aft-journal"; }
+
+		///returns journal path in user cache directory (or current directory), source directory may be read-only
+		static std::string GetUploadPath(const std::string &filename);
+
+		const std::string & GetPath() const
+		{ return _path; }
+
+		///reads journal, returns false if it's missing or malformed
+		bool Load(Record &record) const;
+		///atomically replaces journal content
+		void Save(const Record &record) const;
+		void Remove() const;
+
+		///queries size, modification date and persistent id of the object
+		static Record GetObjectRecord(Session &session, ObjectId objectId);
+		///describes local file by its size and modification time, leaving ObjectId unset
+		static Record GetFileRecord(const std::string &path);
+	};
+
+}
+
+#endif
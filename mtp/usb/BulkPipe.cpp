@@ -95,6 +95,13 @@ namespace mtp { namespace usb
 			stream->Cancel();
 	}
 
+	void BulkPipe::Recover()
+	{
+		_device->DiscardPendingTransfers();
+		_device->ClearHalt(_in);
+		_device->ClearHalt(_out);
+	}
+
 	BulkPipePtr BulkPipe::Create(const usb::DevicePtr & device, const ConfigurationPtr & conf, const usb::InterfacePtr & interface, ITokenPtr claimToken)
 	{
 		int epn = interface->GetEndpointsCount();
@@ -64,6 +64,7 @@ namespace mtp { namespace usb
 		void Read(const IObjectOutputStreamPtr &outputStream, int timeout = 10000);
 		void Write(const IObjectInputStreamPtr &inputStream, int timeout = 10000);
 		void Cancel();
+		void Recover();
 
 		static BulkPipePtr Create(const usb::DevicePtr & device, const ConfigurationPtr & conf, const usb::InterfacePtr & owner, ITokenPtr claimToken);
 	};
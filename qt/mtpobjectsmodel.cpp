@@ -20,6 +20,8 @@
 #include "mtpobjectsmodel.h"
 #include "qtobjectstream.h"
 #include "utils.h"
+#include <mtp/ptp/ByteArrayObjectStream.h>
+#include <mtp/ptp/TransferJournal.h>
 #include <QDebug>
 #include <QBrush>
 #include <QColor>
@@ -192,9 +194,29 @@ bool MtpObjectsModel::uploadFile(const QString &filePath, QString filename)
 
 	qDebug() << "uploadFile " << fileInfo.fileName() << " as " << filename;
 
+	std::string localPath = QFile::encodeName(filePath).toStdString();
+	mtp::TransferJournal journal(mtp::TransferJournal::GetUploadPath(localPath));
+	mtp::TransferJournal::Record record = mtp::TransferJournal::GetFileRecord(localPath);
+	record.Parent = _parentObjectId;
+	bool resumable = _session->EditObjectSupported();
+	bool resume = false;
+
 	bool needReset = false;
 	QModelIndex existingObject = findObject(filename);
-	if (existingObject.isValid())
+	if (existingObject.isValid() && resumable)
+	{
+		mtp::TransferJournal::Record saved;
+		record.ObjectId = _rows.at(existingObject.row()).ObjectId;
+		if (journal.Load(saved) && saved.SameObject(record) && saved.Parent == record.Parent)
+		{
+			record.Storage = saved.Storage;
+			mtp::u64 remoteSize = _session->GetObjectIntegerProperty(record.ObjectId, mtp::ObjectProperty::ObjectSize);
+			record.Offset = std::min(saved.Offset, remoteSize);
+			resume = true;
+		}
+	}
+
+	if (existingObject.isValid() && !resume)
 	{
 		if (!emit existingFileOverwrite(filename))
 		{
@@ -217,14 +239,64 @@ bool MtpObjectsModel::uploadFile(const QString &filePath, QString filename)
 	mtp::msg::ObjectInfo oi;
 	oi.Filename = toUtf8(filename);
 	oi.ObjectFormat = objectFormat;
-	oi.SetSize(fileInfo.size());
-	mtp::Session::NewObjectInfo noi = _session->SendObjectInfo(oi, _storageId != mtp::Session::AllStorages? _storageId: mtp::Session::AnyStorage, _parentObjectId);
-	qDebug() << "new object id: " << noi.ObjectId << ", sending...";
-	_session->SendObject(object);
+	if (!resumable)
+	{
+		oi.SetSize(fileInfo.size());
+		mtp::Session::NewObjectInfo noi = _session->SendObjectInfo(oi, _storageId != mtp::Session::AllStorages? _storageId: mtp::Session::AnyStorage, _parentObjectId);
+		qDebug() << "new object id: " << noi.ObjectId << ", sending...";
+		_session->SendObject(object);
+		record.ObjectId = noi.ObjectId;
+	}
+	else
+	{
+		if (resume)
+			qDebug() << "resuming upload of object" << record.ObjectId << "from" << record.Offset;
+		else
+		{
+			//create empty object and fill it via edit extension, so interrupted upload could be continued
+			mtp::Session::NewObjectInfo noi = _session->SendObjectInfo(oi, _storageId != mtp::Session::AllStorages? _storageId: mtp::Session::AnyStorage, _parentObjectId);
+			qDebug() << "new object id: " << noi.ObjectId << ", sending...";
+			_session->SendObject(std::make_shared<mtp::ByteArrayObjectInputStream>(mtp::ByteArray()));
+			record.ObjectId = noi.ObjectId;
+			record.Storage = noi.StorageId;
+			record.Offset = 0;
+		}
+
+		bool journalled = true;
+		auto checkpoint = [&](mtp::u64 offset)
+		{
+			record.Offset = offset;
+			if (!journalled)
+				return;
+			try
+			{ journal.Save(record); }
+			catch(const std::exception &ex)
+			{
+				qWarning() << "upload will not be resumable:" << ex.what();
+				journalled = false;
+			}
+		};
+		checkpoint(record.Offset);
+
+		if (!object->Seek(record.Offset))
+		{
+			qWarning() << "cannot seek in" << filePath;
+			return false;
+		}
+		{
+			mtp::Session::ObjectEditSession edit(_session, record.ObjectId);
+			edit.Truncate(record.Offset);
+			edit.Send(record.Offset, object, checkpoint);
+		}
+		journal.Remove();
+	}
 	qDebug() << "ok";
-	beginInsertRows(QModelIndex(), _rows.size(), _rows.size());
-	_rows.push_back(Row(noi.ObjectId));
-	endInsertRows();
+	if (!resume)
+	{
+		beginInsertRows(QModelIndex(), _rows.size(), _rows.size());
+		_rows.push_back(Row(record.ObjectId));
+		endInsertRows();
+	}
 	if (needReset)
 		refresh();
 	return true;
@@ -232,6 +304,9 @@ bool MtpObjectsModel::uploadFile(const QString &filePath, QString filename)
 
 bool MtpObjectsModel::downloadFile(const QString &filePath, mtp::ObjectId objectId)
 {
+	if (_session->GetPartialObject64Supported())
+		return downloadFileResumable(filePath, objectId);
+
 	std::shared_ptr<QtObjectOutputStream> object(new QtObjectOutputStream(filePath));
 	if (!object->Valid())
 	{
@@ -243,6 +318,36 @@ bool MtpObjectsModel::downloadFile(const QString &filePath, mtp::ObjectId object
 	return true;
 }
 
+bool MtpObjectsModel::downloadFileResumable(const QString &filePath, mtp::ObjectId objectId)
+{
+	mtp::TransferJournal journal(mtp::TransferJournal::GetPath(QFile::encodeName(filePath).toStdString()));
+	mtp::TransferJournal::Record record = mtp::TransferJournal::GetObjectRecord(*_session, objectId);
+
+	mtp::TransferJournal::Record saved;
+	QFileInfo fileInfo(filePath);
+	if (journal.Load(saved) && saved.SameObject(record) && fileInfo.exists())
+	{
+		record.Offset = std::min<mtp::u64>(saved.Offset, fileInfo.size());
+		qDebug() << "resuming download of" << filePath << "from" << record.Offset;
+	}
+
+	std::shared_ptr<QtObjectOutputStream> object(new QtObjectOutputStream(filePath, record.Offset, record.Size));
+	if (!object->Valid())
+	{
+		qWarning() << "cannot open file " << filePath;
+		return false;
+	}
+	connect(object.get(), SIGNAL(positionChanged(qint64,qint64)), this, SIGNAL(filePositionChanged(qint64,qint64)));
+
+	//chunked transfer, so ui thread could query object info between chunks
+	journal.Save(record);
+	//checkpoint must never point past data which survives a crash
+	_session->GetPartialObject(objectId, record.Offset, record.Size - record.Offset, object,
+		[&](mtp::u64 offset) { object->Sync(); record.Offset = offset; journal.Save(record); });
+	journal.Remove();
+	return true;
+}
+
 MtpObjectsModel::ObjectInfo MtpObjectsModel::getInfoById(mtp::ObjectId objectId) const
 {
 	mtp::msg::ObjectInfo oi(_session->GetObjectInfo(objectId));
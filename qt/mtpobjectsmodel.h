@@ -92,6 +92,7 @@ public:
 	mtp::ObjectId createDirectory(const QString &name, mtp::AssociationType type = mtp::AssociationType::GenericFolder);
 	bool uploadFile(const QString &filePath, QString filename = QString());
 	bool downloadFile(const QString &filePath, mtp::ObjectId objectId);
+	bool downloadFileResumable(const QString &filePath, mtp::ObjectId objectId);
 	void rename(int idx, const QString &fileName);
 	ObjectInfo getInfoById(mtp::ObjectId objectId) const;
 	void deleteObjects(const MtpObjectList &objects);
@@ -23,6 +23,7 @@
 #include <QObject>
 #include <QFile>
 #include <mtp/ptp/IObjectStream.h>
+#include <unistd.h>
 
 class QtObjectInputStream : public QObject, public mtp::IObjectInputStream, public mtp::CancellableStream
 {
@@ -46,6 +47,9 @@ public:
 	virtual mtp::u64 GetSize() const
 	{ return _size; }
 
+	virtual bool Seek(mtp::u64 offset)
+	{ return _file.seek(offset); }
+
 	virtual size_t Read(mtp::u8 *data, size_t size)
 	{
 		CheckCancelled();
@@ -69,9 +73,17 @@ private:
 	qint64		_size;
 
 public:
-	QtObjectOutputStream(const QString &file): _file(file)
+	QtObjectOutputStream(const QString &file): _file(file), _size(0)
 	{ _file.open(QFile::WriteOnly | QFile::Truncate); }
 
+	//! keeps first offset bytes of existing file and continues writing after them
+	QtObjectOutputStream(const QString &file, qint64 offset, qint64 size): _file(file), _size(size)
+	{
+		//WriteOnly implies truncation for QFile, ReadWrite keeps content
+		if (_file.open(QFile::ReadWrite) && (!_file.resize(offset) || !_file.seek(offset)))
+			_file.close();
+	}
+
 	bool Valid() const
 	{ return _file.isOpen(); }
 
@@ -84,6 +96,12 @@ public:
 		emit positionChanged(_file.pos(), _size);
 		return r;
 	}
+
+	virtual void Sync()
+	{
+		if (!_file.flush() || fsync(_file.handle()) != 0)
+			throw std::runtime_error("cannot sync " + _file.fileName().toStdString());
+	}
 };
 
 #endif // QTOBJECTSTREAM_H